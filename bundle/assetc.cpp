@@ -0,0 +1,661 @@
+#include "meshcache.hpp"
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/printf.h>
+#include <magic_enum.hpp>
+
+namespace fs = std::filesystem;
+
+// bump whenever a stage changes its output so that every model is rebuilt
+static constexpr std::uint64_t AssetPipelineVersion{1};
+// simplified levels built below the full-detail mesh
+static constexpr int LodLevels{3};
+// grid cells along the longest side of the bounding box for the first
+// simplified level, halved for every level after it
+static constexpr int LodBaseResolution{64};
+// vertices whose positions and normals are closer than this are merged by
+// the weld stage
+static constexpr float WeldEpsilon{1e-5f};
+static constexpr float WeldNormalEpsilon{1e-3f};
+// triangles or vertices handled by one task inside a single model
+static constexpr std::size_t ChunkSize{16384};
+
+static constexpr char const* ManifestName{"assetc.manifest"};
+
+enum class Stage
+{
+    Hash,
+    Parse,
+    Weld,
+    Optimize,
+    Normals,
+    Lod,
+    Serialize
+};
+
+static constexpr std::size_t StageCount{magic_enum::enum_count<Stage>()};
+
+// wall time spent in each stage, summed over all models
+struct StageTimes
+{
+    std::array<std::atomic<std::int64_t>, StageCount> nanoseconds{};
+    std::array<std::atomic<std::size_t>, StageCount> runs{};
+};
+
+struct Asset
+{
+    fs::path input;
+    fs::path output;
+    std::string key; //output path relative to the output directory
+    std::uint64_t hash{0};
+    bool upToDate{false};
+    std::atomic<bool> failed{false}; //the LOD tasks of a model run side by side
+    MeshData mesh;
+    std::vector<MeshData> lods;
+};
+
+// ===----------------HELPERS-----------------===
+
+template <typename Fn>
+void timed(StageTimes& times, Stage stage, Fn const& fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    auto index = magic_enum::enum_integer(stage);
+    times.nanoseconds[index] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    times.runs[index]++;
+}
+
+// wraps the body of a stage task. Tasks must not throw, so a model whose
+// stage runs out of memory or trips over a malformed file is marked as
+// failed instead and the other models carry on
+template <typename Fn>
+auto guarded(Asset& asset, Fn fn)
+{
+    return [&asset, fn]() noexcept {
+        try
+        {
+            fn();
+        }
+        catch (...)
+        {
+            asset.failed = true;
+        }
+    };
+}
+
+// FNV-1a over the file contents, seeded with the pipeline version
+std::uint64_t hashFile(fs::path const& path)
+{
+    std::uint64_t hash{14695981039346656037ull ^ AssetPipelineVersion};
+
+    std::ifstream file{path, std::ios::binary};
+    std::array<char, 1 << 16> buffer;
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+    {
+        for (std::streamsize i{0}; i < file.gcount(); ++i)
+        {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+std::map<std::string, std::uint64_t> readManifest(fs::path const& path)
+{
+    std::map<std::string, std::uint64_t> manifest;
+
+    std::ifstream file{path};
+    std::uint64_t hash;
+    std::string key;
+    while (file >> std::hex >> hash && std::getline(file >> std::ws, key))
+    {
+        manifest[key] = hash;
+    }
+    return manifest;
+}
+
+void writeManifest(fs::path const& path, std::deque<Asset> const& assets)
+{
+    std::ofstream file{path, std::ios::trunc};
+    for (Asset const& asset : assets)
+    {
+        if (!asset.failed)
+        {
+            file << fmt::format("{:016x} {}\n", asset.hash, asset.key);
+        }
+    }
+}
+
+// every .obj file below dir. Directories that cannot be read are skipped
+// and added to skipped with the reason, so one bad directory does not end
+// the whole run
+std::vector<fs::path> findModels(fs::path const& dir, std::vector<std::string>& skipped)
+{
+    std::vector<fs::path> models;
+
+    std::error_code ec;
+    fs::recursive_directory_iterator it{dir, fs::directory_options::skip_permission_denied, ec};
+    for (fs::recursive_directory_iterator end; !ec && it != end; it.increment(ec))
+    {
+        fs::directory_entry const& entry = *it;
+        std::error_code entryEc;
+        if (entry.is_directory(entryEc))
+        {
+            // look inside first, the iterator would stop at the first error
+            fs::directory_iterator probe{entry.path(), entryEc};
+            if (entryEc)
+            {
+                skipped.push_back(fmt::format("{} ({})", entry.path().string(), entryEc.message()));
+                it.disable_recursion_pending();
+            }
+            continue;
+        }
+
+        auto extension = entry.path().extension();
+        if (entry.is_regular_file(entryEc) && (extension == ".obj" || extension == ".OBJ"))
+        {
+            models.push_back(entry.path());
+        }
+    }
+    if (ec)
+    {
+        skipped.push_back(fmt::format("rest of {} ({})", dir.string(), ec.message()));
+    }
+    return models;
+}
+
+// ===----------------STAGES------------------===
+
+// all shapes of the file merged into one mesh
+bool parse(Asset& asset)
+{
+    auto obj = atlas::utils::loadObjMesh(asset.input.string());
+    if (!obj)
+    {
+        return false;
+    }
+
+    for (atlas::utils::Shape const& shape : obj->shapes)
+    {
+        auto base = static_cast<std::uint32_t>(asset.mesh.vertices.size());
+        for (atlas::utils::Vertex const& v : shape.vertices)
+        {
+            SimpleVertex sV;
+            sV.position = v.position;
+            sV.normal = v.normal;
+            asset.mesh.vertices.push_back(sV);
+        }
+        for (std::size_t i : shape.indices)
+        {
+            asset.mesh.indices.push_back(base + static_cast<std::uint32_t>(i));
+        }
+    }
+    return !asset.mesh.indices.empty();
+}
+
+struct WeldKey
+{
+    std::int64_t x;
+    std::int64_t y;
+    std::int64_t z;
+    std::int64_t nx;
+    std::int64_t ny;
+    std::int64_t nz;
+
+    bool operator==(WeldKey const& other) const
+    {
+        return x == other.x && y == other.y && z == other.z &&
+            nx == other.nx && ny == other.ny && nz == other.nz;
+    }
+};
+
+struct WeldKeyHash
+{
+    std::size_t operator()(WeldKey const& key) const
+    {
+        // unsigned, so large coordinates wrap instead of overflowing
+        auto u = [](std::int64_t v) { return static_cast<std::uint64_t>(v); };
+        return static_cast<std::size_t>(
+            (u(key.x) * 73856093u) ^ (u(key.y) * 19349663u) ^ (u(key.z) * 83492791u) ^
+            (u(key.nx) * 2654435761u) ^ (u(key.ny) * 40503u) ^ (u(key.nz) * 2246822519u));
+    }
+};
+
+// merges vertices that share a position and a normal, so hard edges keep
+// their split vertices. Vertices without a normal weld with each other and
+// get a smooth one from the normals stage
+void weld(MeshData& mesh)
+{
+    std::unordered_map<WeldKey, std::uint32_t, WeldKeyHash> unique;
+    unique.reserve(mesh.vertices.size());
+
+    std::vector<SimpleVertex> welded;
+    std::vector<std::uint32_t> remap(mesh.vertices.size());
+    for (std::size_t i{0}; i < mesh.vertices.size(); ++i)
+    {
+        auto const& p = mesh.vertices[i].position;
+        auto const& n = mesh.vertices[i].normal;
+        WeldKey key{std::llround(p.x / WeldEpsilon),
+                    std::llround(p.y / WeldEpsilon),
+                    std::llround(p.z / WeldEpsilon),
+                    std::llround(n.x / WeldNormalEpsilon),
+                    std::llround(n.y / WeldNormalEpsilon),
+                    std::llround(n.z / WeldNormalEpsilon)};
+
+        auto [it, inserted] = unique.try_emplace(key, static_cast<std::uint32_t>(welded.size()));
+        if (inserted)
+        {
+            welded.push_back(mesh.vertices[i]);
+        }
+        remap[i] = it->second;
+    }
+
+    for (std::uint32_t& index : mesh.indices)
+    {
+        index = remap[index];
+    }
+    mesh.vertices = std::move(welded);
+}
+
+// drops degenerate triangles and unused vertices, then stores the vertices
+// in the order the index buffer first touches them so the GPU fetches them
+// mostly sequentially
+void optimize(MeshData& mesh)
+{
+    static constexpr std::uint32_t Unused{~0u};
+
+    std::vector<std::uint32_t> kept;
+    kept.reserve(mesh.indices.size());
+    for (std::size_t t{0}; t + 2 < mesh.indices.size(); t += 3)
+    {
+        std::uint32_t a = mesh.indices[t];
+        std::uint32_t b = mesh.indices[t + 1];
+        std::uint32_t c = mesh.indices[t + 2];
+        if (a != b && b != c && a != c)
+        {
+            kept.insert(kept.end(), {a, b, c});
+        }
+    }
+
+    std::vector<std::uint32_t> remap(mesh.vertices.size(), Unused);
+    std::vector<SimpleVertex> ordered;
+    ordered.reserve(mesh.vertices.size());
+    for (std::uint32_t& index : kept)
+    {
+        if (remap[index] == Unused)
+        {
+            remap[index] = static_cast<std::uint32_t>(ordered.size());
+            ordered.push_back(mesh.vertices[index]);
+        }
+        index = remap[index];
+    }
+
+    mesh.vertices = std::move(ordered);
+    mesh.indices = std::move(kept);
+}
+
+// area weighted smooth normals for the vertices the OBJ gave none, authored
+// normals are kept. Both passes are split across the pool
+void generateNormals(ThreadPool& pool, MeshData& mesh)
+{
+    auto missing = [](SimpleVertex const& v) { return glm::length(v.normal) == 0.0f; };
+    if (std::none_of(mesh.vertices.begin(), mesh.vertices.end(), missing))
+    {
+        return;
+    }
+
+    std::size_t triangleCount = mesh.indices.size() / 3;
+    std::size_t vertexCount = mesh.vertices.size();
+
+    // the cross product is twice the triangle area, so larger faces weigh more
+    std::vector<atlas::math::Normal> faceNormals(triangleCount);
+    parallelFor(pool, triangleCount, ChunkSize, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t t{begin}; t < end; ++t)
+        {
+            auto const& a = mesh.vertices[mesh.indices[3 * t]].position;
+            auto const& b = mesh.vertices[mesh.indices[3 * t + 1]].position;
+            auto const& c = mesh.vertices[mesh.indices[3 * t + 2]].position;
+            faceNormals[t] = glm::cross(b - a, c - a);
+        }
+    });
+
+    // triangles around each vertex, so the second pass can gather without
+    // two tasks writing the same vertex
+    std::vector<std::uint32_t> offsets(vertexCount + 1, 0);
+    for (std::uint32_t index : mesh.indices)
+    {
+        offsets[index + 1]++;
+    }
+    for (std::size_t v{0}; v < vertexCount; ++v)
+    {
+        offsets[v + 1] += offsets[v];
+    }
+    std::vector<std::uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+    std::vector<std::uint32_t> adjacency(mesh.indices.size());
+    for (std::size_t i{0}; i < mesh.indices.size(); ++i)
+    {
+        adjacency[cursor[mesh.indices[i]]++] = static_cast<std::uint32_t>(i / 3);
+    }
+
+    parallelFor(pool, vertexCount, ChunkSize, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t v{begin}; v < end; ++v)
+        {
+            if (!missing(mesh.vertices[v]))
+            {
+                continue;
+            }
+
+            atlas::math::Normal sum{0.0f};
+            for (std::uint32_t i{offsets[v]}; i < offsets[v + 1]; ++i)
+            {
+                sum += faceNormals[adjacency[i]];
+            }
+            mesh.vertices[v].normal =
+                glm::length(sum) > 0.0f ? glm::normalize(sum) : atlas::math::Normal{0.0f, 1.0f, 0.0f};
+        }
+    });
+}
+
+// vertex clustering: every vertex snaps to the average of its grid cell and
+// triangles that collapse are dropped
+MeshData buildLod(MeshData const& mesh, int resolution)
+{
+    if (mesh.vertices.empty())
+    {
+        return mesh;
+    }
+
+    atlas::math::Point lower = mesh.vertices[0].position;
+    atlas::math::Point upper = mesh.vertices[0].position;
+    for (SimpleVertex const& v : mesh.vertices)
+    {
+        lower = glm::min(lower, v.position);
+        upper = glm::max(upper, v.position);
+    }
+
+    auto extent = upper - lower;
+    float cellSize = std::max({extent.x, extent.y, extent.z}) / resolution;
+    if (cellSize <= 0.0f)
+    {
+        return mesh;
+    }
+
+    struct Cell
+    {
+        atlas::math::Point position{0.0f};
+        atlas::math::Normal normal{0.0f};
+        std::uint32_t count{0};
+    };
+
+    std::unordered_map<std::int64_t, std::uint32_t> cellIndex;
+    std::vector<Cell> cells;
+    std::vector<std::uint32_t> remap(mesh.vertices.size());
+    std::int64_t stride = resolution + 1;
+    for (std::size_t i{0}; i < mesh.vertices.size(); ++i)
+    {
+        auto cell = (mesh.vertices[i].position - lower) / cellSize;
+        std::int64_t key = static_cast<std::int64_t>(cell.x) +
+            stride * (static_cast<std::int64_t>(cell.y) + stride * static_cast<std::int64_t>(cell.z));
+
+        auto [it, inserted] = cellIndex.try_emplace(key, static_cast<std::uint32_t>(cells.size()));
+        if (inserted)
+        {
+            cells.emplace_back();
+        }
+        Cell& c = cells[it->second];
+        c.position += mesh.vertices[i].position;
+        c.normal += mesh.vertices[i].normal;
+        c.count++;
+        remap[i] = it->second;
+    }
+
+    MeshData lod;
+    lod.vertices.reserve(cells.size());
+    for (Cell const& c : cells)
+    {
+        SimpleVertex v;
+        v.position = c.position / static_cast<float>(c.count);
+        v.normal = glm::length(c.normal) > 0.0f ? glm::normalize(c.normal) : atlas::math::Normal{0.0f, 1.0f, 0.0f};
+        lod.vertices.push_back(v);
+    }
+    for (std::size_t t{0}; t + 2 < mesh.indices.size(); t += 3)
+    {
+        std::uint32_t a = remap[mesh.indices[t]];
+        std::uint32_t b = remap[mesh.indices[t + 1]];
+        std::uint32_t c = remap[mesh.indices[t + 2]];
+        if (a != b && b != c && a != c)
+        {
+            lod.indices.insert(lod.indices.end(), {a, b, c});
+        }
+    }
+
+    // clusters that no longer belong to any triangle are dropped here
+    optimize(lod);
+    return lod;
+}
+
+// writes to a temporary file first so an interrupted run never leaves a
+// truncated cache behind
+bool serialize(Asset& asset)
+{
+    std::vector<MeshData> levels;
+    levels.reserve(1 + asset.lods.size());
+    levels.push_back(std::move(asset.mesh));
+    for (MeshData& lod : asset.lods)
+    {
+        levels.push_back(std::move(lod));
+    }
+
+    std::error_code ec;
+    fs::create_directories(asset.output.parent_path(), ec);
+
+    fs::path temporary{asset.output};
+    temporary += ".tmp";
+    if (!writeMeshCache(temporary.string(), levels))
+    {
+        return false;
+    }
+    fs::rename(temporary, asset.output, ec);
+    return !ec;
+}
+
+// ===-----------------DRIVER-----------------===
+
+void printUsage()
+{
+    fmt::print("usage: assetc <input directory> [-o <output directory>] [-j <threads>]\n"
+               "converts every .obj file below the input directory into a binary\n"
+               "mesh cache (.mesh), skipping files that have not changed since the last run\n");
+}
+
+int main(int argc, char* argv[])
+{
+    fs::path inputDir;
+    fs::path outputDir;
+    std::size_t threads{std::thread::hardware_concurrency()};
+
+    for (int i{1}; i < argc; ++i)
+    {
+        std::string arg{argv[i]};
+        if (arg == "-o" && i + 1 < argc)
+        {
+            outputDir = argv[++i];
+        }
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            std::string_view value{argv[++i]};
+            auto [last, error] = std::from_chars(value.data(), value.data() + value.size(), threads);
+            if (error != std::errc{} || last != value.data() + value.size() || threads == 0)
+            {
+                fmt::print("invalid thread count: {}\n", value);
+                printUsage();
+                return 1;
+            }
+        }
+        else if (inputDir.empty() && arg[0] != '-')
+        {
+            inputDir = arg;
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    std::error_code ec;
+    if (inputDir.empty() || !fs::is_directory(inputDir, ec))
+    {
+        printUsage();
+        return 1;
+    }
+    // by default the caches go next to the models, where a3 looks for them
+    if (outputDir.empty())
+    {
+        outputDir = inputDir;
+    }
+
+    std::vector<std::string> skipped;
+    std::deque<Asset> assets;
+    for (fs::path const& model : findModels(inputDir, skipped))
+    {
+        // lexically, so nothing here touches the file system again
+        fs::path relative = model.lexically_relative(inputDir);
+        Asset& asset = assets.emplace_back();
+        asset.input = model;
+        asset.output = outputDir / relative.replace_extension(".mesh");
+        asset.key = relative.generic_string();
+    }
+    for (std::string const& path : skipped)
+    {
+        fmt::print("skipped: {}\n", path);
+    }
+
+    auto const manifest = readManifest(outputDir / ManifestName);
+    StageTimes times;
+    ThreadPool pool{threads};
+    TaskGraph graph;
+
+    // hash -> parse -> weld -> optimize -> normals -> lods (in parallel) -> serialize;
+    // later stages return straight away for skipped or failed models
+    for (Asset& asset : assets)
+    {
+        auto hash = graph.add(guarded(asset, [&]() {
+            timed(times, Stage::Hash, [&]() {
+                asset.hash = hashFile(asset.input);
+                auto it = manifest.find(asset.key);
+                std::error_code missing;
+                asset.upToDate = it != manifest.end() && it->second == asset.hash && fs::exists(asset.output, missing);
+            });
+        }));
+        auto parseTask = graph.add(guarded(asset, [&]() {
+            if (asset.upToDate)
+            {
+                return;
+            }
+            timed(times, Stage::Parse, [&]() { asset.failed = !parse(asset); });
+        }));
+        auto weldTask = graph.add(guarded(asset, [&]() {
+            if (!asset.upToDate && !asset.failed)
+            {
+                timed(times, Stage::Weld, [&]() { weld(asset.mesh); });
+            }
+        }));
+        auto optimizeTask = graph.add(guarded(asset, [&]() {
+            if (!asset.upToDate && !asset.failed)
+            {
+                timed(times, Stage::Optimize, [&]() { optimize(asset.mesh); });
+            }
+        }));
+        auto normalsTask = graph.add(guarded(asset, [&]() {
+            if (!asset.upToDate && !asset.failed)
+            {
+                timed(times, Stage::Normals, [&]() { generateNormals(pool, asset.mesh); });
+                asset.lods.resize(LodLevels);
+            }
+        }));
+        auto serializeTask = graph.add(guarded(asset, [&]() {
+            if (!asset.upToDate && !asset.failed)
+            {
+                timed(times, Stage::Serialize, [&]() { asset.failed = !serialize(asset); });
+            }
+            // nothing but the manifest entry is needed from here on
+            asset.mesh = MeshData{};
+            asset.lods = std::vector<MeshData>{};
+        }));
+
+        graph.precede(hash, parseTask);
+        graph.precede(parseTask, weldTask);
+        graph.precede(weldTask, optimizeTask);
+        graph.precede(optimizeTask, normalsTask);
+        for (int level{0}; level < LodLevels; ++level)
+        {
+            auto lodTask = graph.add(guarded(asset, [&, level]() {
+                if (!asset.upToDate && !asset.failed)
+                {
+                    timed(times, Stage::Lod, [&]() {
+                        asset.lods[level] = buildLod(asset.mesh, LodBaseResolution >> level);
+                    });
+                }
+            }));
+            graph.precede(normalsTask, lodTask);
+            graph.precede(lodTask, serializeTask);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    graph.run(pool);
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - start;
+
+    fs::create_directories(outputDir, ec);
+    writeManifest(outputDir / ManifestName, assets);
+
+    std::size_t upToDate{0};
+    std::size_t failed{0};
+    for (Asset const& asset : assets)
+    {
+        if (asset.failed)
+        {
+            fmt::print("failed: {}\n", asset.input.string());
+            failed++;
+        }
+        else if (asset.upToDate)
+        {
+            upToDate++;
+        }
+    }
+
+    fmt::print("{} models: {} converted, {} up to date, {} failed ({} threads, {:.1f} ms)\n",
+        assets.size(), assets.size() - upToDate - failed, upToDate, failed, pool.threadCount(), wall.count());
+    fmt::print("{:<10} {:>8} {:>12} {:>10}\n", "stage", "runs", "total ms", "avg ms");
+    for (std::size_t i{0}; i < StageCount; ++i)
+    {
+        double total = times.nanoseconds[i] / 1e6;
+        std::size_t runs = times.runs[i];
+        fmt::print("{:<10} {:>8} {:>12.1f} {:>10.3f}\n",
+            magic_enum::enum_name(magic_enum::enum_value<Stage>(i)), runs, total, runs > 0 ? total / runs : 0.0);
+    }
+
+    return failed > 0 ? 1 : 0;
+}
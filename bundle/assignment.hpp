@@ -1,10 +1,19 @@
 #pragma once
 
+#include "meshcache.hpp"
 #include "paths.hpp"
+#include "threadpool.hpp"
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <atlas/glx/Buffer.hpp>
 #include <atlas/glx/Context.hpp>
@@ -13,6 +22,8 @@
 #include <atlas/utils/Cameras.hpp>
 #include <atlas/utils/LoadObjFile.hpp>
 
+#include <glm/gtc/quaternion.hpp>
+
 #include <fmt/printf.h>
 #include <magic_enum.hpp>
 
@@ -24,22 +35,140 @@ static constexpr float farVal{10000000000.0f};
 
 static const std::vector<std::string> IncludeDir{ShaderPath};
 
+// how long the idle loop blocks before checking the shaders on disk again
+static constexpr double IdleWaitTimeout{0.25};
+// how often the shader files are checked for edits while drawing
+static constexpr double ShaderPollInterval{0.25};
+// how long the window size has to stay put before the cached frame is re-shaded
+static constexpr double ResizeSettleTime{0.2};
+
+// largest time step the camera integrates in one frame, so a stall does not
+// teleport it
+static constexpr float MaxFrameDelta{0.1f};
+// how far ahead of the deadline the frame limiter stops sleeping and spins
+static constexpr double SpinThreshold{0.002};
+// left free before the vertical blank in the vsync modes, for the GPU and
+// the compositor to finish a frame whose CPU side just ended
+static constexpr double VSyncSlack{0.004};
+// how often the frame statistics are printed
+static constexpr double StatsInterval{1.0};
+// size of the per-frame scratch memory, allocated once up front
+static constexpr std::size_t FrameArenaSize{1 << 20};
+
+// default limits for ResidencyManager
+static constexpr std::size_t DefaultGpuBudget{256 << 20};
+static constexpr std::size_t DefaultCpuBudget{512 << 20};
+
+// size of the stress scene toggled with B and used by --bench-record
+static constexpr std::size_t SceneObjectCount{100000};
+static constexpr float SceneSpacing{3.0f};
+// frames timed per thread count by --bench-record
+static constexpr int BenchmarkFrames{100};
+
+// hierarchy updated by --bench-transforms, built from assemblies of parts
+static constexpr std::size_t TransformBenchNodes{1000000};
+static constexpr std::size_t TransformAssemblySize{1000};
+// one in this many nodes changes every benchmark frame
+static constexpr std::size_t TransformChangeRatio{100};
+
+// nodes whose local matrices are built together in one vectorized batch
+static constexpr std::size_t TransformBatch{64};
+// subtrees larger than this are split across the pool below their root
+static constexpr std::size_t SubtreeSplitSize{4096};
+// changed subtrees handed to one task
+static constexpr std::size_t SubtreesPerTask{64};
+// changed ranges closer than this many nodes are uploaded as one
+static constexpr std::size_t UploadMergeGap{16};
+// ranges waiting for upload() before they are collapsed into one
+static constexpr std::size_t MaxUploadRanges{4096};
+// shader storage binding of the world matrices, matches instanced.vert
+static constexpr GLuint TransformBufferBinding{0};
+
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+// frames drawn before allocations are counted (first-use setup is allowed)
+static constexpr int AllocationCheckWarmup{60};
+// steady-state frames checked before the program exits
+static constexpr int AllocationCheckFrames{1000};
+
+// number of calls to the global operator new so far
+std::size_t heapAllocationCount();
+#endif
+
+// controls when Program::run draws a new frame
+enum class RedrawMode
+{
+    Continuous,    // redraw every vsync interval
+    OnDemand,      // redraw only when something changed, otherwise block
+    OnDemandCached // as OnDemand, but re-present the last frame from an FBO
+                   // on resize and expose instead of shading it again
+};
+
 struct OpenGLError : std::runtime_error
 {
     OpenGLError(const std::string& what_arg) : std::runtime_error(what_arg){};
     OpenGLError(const char* what_arg) : std::runtime_error(what_arg){};
 };
 
-struct SimpleVertex
+struct FrameAllocationError : std::runtime_error
 {
-    math::Point position{};
-    math::Normal normal{};
+    FrameAllocationError(const std::string& what_arg) : std::runtime_error(what_arg){};
+    FrameAllocationError(const char* what_arg) : std::runtime_error(what_arg){};
 };
+
 // default camera values
 const float YAW = -90.0f;
 const float PITCH = 0.0f;
 const float SENSITIVITY = 0.05f;
 
+// linear allocator for transient render data (draw lists, sort keys...),
+// the memory is allocated once and handed out again after every reset()
+class FrameArena
+{
+public:
+    FrameArena(std::size_t capacity);
+
+    // throws FrameAllocationError when the frame needs more than capacity
+    void* allocate(std::size_t bytes, std::size_t alignment);
+
+    template <typename T>
+    T* allocate(std::size_t count)
+    {
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // called once at the start of every frame
+    void reset();
+
+    std::size_t used() const { return mOffset; }
+    std::size_t highWater() const { return mHighWater; }
+
+private:
+    std::unique_ptr<std::byte[]> mBuffer;
+    std::size_t mCapacity;
+    std::size_t mOffset;
+    std::size_t mHighWater;
+};
+
+// controls how Program::run paces the frames it does draw
+enum class FramePacing
+{
+    VSync,         // wait for vertical blank
+    AdaptiveVSync, // wait for vertical blank unless the frame is late (falls back to VSync)
+    Uncapped,      // present as fast as possible
+    TargetRate     // present at a fixed rate with sleep-then-spin timing
+};
+
+// rolling frame timings, printed every StatsInterval seconds
+struct FrameStats
+{
+    int frames{0};
+    double windowStart{0.0};
+    double lastPresent{0.0};
+    double frameTime{0.0};
+    double latency{0.0};
+    double maxLatency{0.0};
+};
+
 class Light {
 public:
     Colour mColour;
@@ -54,7 +183,7 @@ public:
 
     float mRadiance;
 
-    Colour L() {
+    Colour L() const {
         return mColour * mRadiance;
     }
 
@@ -70,7 +199,7 @@ public:
 
     float mRadiance;
 
-    Colour L() {
+    Colour L() const {
         return mRadiance * mColour;
     }
 
@@ -86,7 +215,7 @@ public:
 
     float mRadiance;
 
-    Colour L() {
+    Colour L() const {
         return mRadiance * mColour;
     }
 
@@ -109,30 +238,184 @@ private:
 
 };
 
+// local translation, rotation and scale of a node hierarchy, stored as
+// structure-of-arrays in depth-first order so every subtree is one
+// contiguous range of slots. update() only recomputes the world matrices
+// below nodes that changed, independent subtrees in parallel
+class TransformSystem
+{
+public:
+    using Node = std::uint32_t;
+    static constexpr Node NoParent{~0u};
+
+    TransformSystem(ThreadPool& pool);
+
+    // the parent must already exist, so a parent is always added before its children
+    Node add(Node parent,
+             math::Point translation = math::Point{0.0f},
+             glm::quat rotation = glm::quat{1.0f, 0.0f, 0.0f, 0.0f},
+             math::Vector scale = math::Vector{1.0f});
+
+    void setTranslation(Node node, math::Point translation);
+    void setRotation(Node node, glm::quat rotation);
+    void setScale(Node node, math::Vector scale);
+
+    // returns true if any world matrix changed
+    bool update();
+
+    // brings the GPU copy of the world matrices, one per slot, up to date
+    // with every update since the last call. Only the changed ranges are
+    // written, returns the number of bytes uploaded
+    std::size_t upload();
+    GLuint buffer() const { return mBuffer; }
+    void freeGPUData();
+
+    math::Matrix4 const& world(Node node) const { return mWorld[mSlot[node]]; }
+    // position of the node's matrix in the uploaded buffer, changes when nodes are added
+    std::size_t slot(Node node) const { return mSlot[node]; }
+    std::size_t size() const { return mNode.size(); }
+
+    // nodes recomputed by the last update
+    std::size_t recomputed() const { return mRecomputed; }
+    // slot ranges [first, second) changed by the last update
+    std::vector<std::pair<std::size_t, std::size_t>> const& changedRanges() const { return mChanged; }
+
+private:
+    void markDirty(std::size_t slot);
+    void sortDepthFirst();
+    void updateSubtree(std::size_t root);
+    void computeRange(std::size_t begin, std::size_t end);
+
+    ThreadPool& mPool;
+    bool mOrderDirty;
+
+    // indexed by node
+    std::vector<Node> mParentNode;
+    std::vector<std::uint32_t> mSlot;
+
+    // indexed by slot
+    std::vector<Node> mNode;
+    std::vector<std::uint32_t> mParent; //slot of the parent or NoParent
+    std::vector<std::uint32_t> mSubtreeEnd; //one past the last descendant
+    std::vector<float> mTx, mTy, mTz;
+    std::vector<float> mQx, mQy, mQz, mQw;
+    std::vector<float> mSx, mSy, mSz;
+    std::vector<std::uint8_t> mDirty;
+    std::vector<math::Matrix4> mWorld;
+
+    std::vector<std::uint32_t> mDirtySlots;
+    std::vector<std::pair<std::size_t, std::size_t>> mChanged;
+    std::size_t mRecomputed;
+
+    GLuint mBuffer{};
+    std::size_t mBufferSlots{};
+    std::vector<std::pair<std::size_t, std::size_t>> mUploadRanges;
+};
+
+// everything an object needs to draw itself, built once per frame
+struct RenderContext
+{
+    bool paused;
+    int width;
+    int height;
+    math::Matrix4 projMat;
+    math::Matrix4 viewMat;
+    Camera const& camera;
+    glm::vec3 ambient;
+    PointLight const& pointLight;
+    Directional const& directional;
+    bool specularFlag;
+    bool directionalFlag;
+    FrameArena& arena;
+};
+
+class Object;
+
+// one entry of the per-frame draw list, sorted by key to group state changes
+struct DrawItem
+{
+    std::uint64_t sortKey;
+    Object* object;
+};
+
 class Object
 {
 public:
     void loadShaders();
 
-    void reloadShaders();
+    bool reloadShaders(); //returns true if either shader was recompiled
 
-    void freeGPUData();
+    virtual void freeGPUData();
+
+    // set whenever the object would look different if drawn again
+    bool isDirty() const { return mDirty; }
+    void markDirty() { mDirty = true; }
+    void clearDirty() { mDirty = false; }
 
     virtual void loadDataToGPU() = 0;
 
-    virtual void render(bool paused, int width, int height, Camera cam, glm::vec3 ambient, 
-        PointLight pointLight, Directional directional, bool specularFlag, bool directionalFlag) = 0;
+    virtual void render(RenderContext const& ctx) = 0;
+
+    // geometry, shared with InstancedScene
+    GLuint vertexBuffer() const { return mVbo; }
+    GLuint indexBuffer() const { return mEbo; } //0 if drawn with glDrawArrays
+    virtual GLsizei elementCount() const = 0; //indices, or vertices if not indexed
+    float boundingRadius() const { return mBoundingRadius; } //around the model origin
+
+    // GPU residency, managed by ResidencyManager
+    bool isResident() const { return mVao != 0; }
+    std::size_t gpuBytes() const { return mGpuBytes; } //size of the last upload
+    virtual std::size_t cpuBytes() const = 0;
+    // deletes the vertex/index buffers but keeps the shaders
+    void releaseBuffers();
+    // bumped by releaseBuffers, anything built on the buffers is stale once it changes
+    std::uint32_t bufferGeneration() const { return mBufferGeneration; }
+    // users are told before the buffers go so they can drop their references,
+    // GL would keep deleted buffers alive while a vertex array still holds them
+    void addBufferUser(Object& user);
+    void removeBufferUser(Object& user);
+    // uploads the buffers again, returns the number of bytes uploaded
+    virtual std::size_t restream();
+    // the CPU copy can only be dropped if it can be restored later
+    virtual bool canDropCPUData() const { return false; }
+    virtual void dropCPUData() {}
+    // asks the residency manager to keep the CPU copy while RAM allows it
+    void keepCPUCopy(bool keep) { mKeepCPUCopy = keep; }
+    bool keepsCPUCopy() const { return mKeepCPUCopy; }
+
+    // orders draws by shader program, then vertex array
+    std::uint64_t sortKey() const;
+
+    // the model matrix follows the node's world matrix, identity if never set
+    void setTransform(TransformSystem const& transforms, TransformSystem::Node node);
+    math::Matrix4 const& modelMatrix() const;
+    TransformSystem::Node transformNode() const { return mTransformNode; }
 
 protected:
     void setupUniformVariables(); //called at end of render
 
+    void bindUniforms(RenderContext const& ctx, math::Matrix4 const& modelMat, Colour const& colour);
+
+    virtual void buffersReleased([[maybe_unused]] Object const& owner) {}
+
     float position;
 
+    bool mDirty{true};
+    float mBoundingRadius{0.0f};
+    std::string mVertexShaderFile{"triangle.vert"};
+
     // Vertex buffers.
-    GLuint mVao;
-    GLuint mVbo;
+    GLuint mVao{};
+    GLuint mVbo{};
     // Index Buffer
-    GLuint mEbo;
+    GLuint mEbo{};
+    std::size_t mGpuBytes{};
+    bool mKeepCPUCopy{false};
+    std::uint32_t mBufferGeneration{0};
+    std::vector<Object*> mBufferUsers;
+
+    TransformSystem const* mTransforms{nullptr};
+    TransformSystem::Node mTransformNode{};
 
     // Shader data.
     GLuint mVertHandle;
@@ -168,12 +451,26 @@ protected:
 class Mesh : public Object
 {
 public:
-    Mesh(atlas::utils::ObjMesh, Colour colour);
+    // a non-empty cache path lets the mesh drop its CPU copy after upload
+    // and stream it back from disk when it gets evicted
+    Mesh(MeshData data, Colour colour, std::string cachePath = {});
+    // also writes the binary cache if cachePath is set
+    Mesh(atlas::utils::ObjMesh, Colour colour, std::string cachePath = {});
     Colour mColour;
     std::vector<SimpleVertex> mVertices;
     std::vector<GLuint> mIndices;
+    GLsizei mIndexCount;
+    std::string mCachePath;
+    //sets the index count and bounding radius from the CPU copy
+    void measure();
     void loadDataToGPU();
-    void render(bool paused, int width, int height, Camera cam, glm::vec3 ambient, PointLight pointLight, Directional directional, bool specularFlag, bool directionalFlag);
+    void render(RenderContext const& ctx);
+
+    GLsizei elementCount() const { return mIndexCount; }
+    std::size_t cpuBytes() const;
+    std::size_t restream();
+    bool canDropCPUData() const;
+    void dropCPUData();
 
 };
 
@@ -186,7 +483,10 @@ public:
 
     void loadDataToGPU();
 
-    void render(bool paused, int width, int height, Camera cam, glm::vec3 ambient, PointLight pointLight, Directional directional, bool specularFlag, bool directionalFlag);
+    void render(RenderContext const& ctx);
+
+    GLsizei elementCount() const { return 3*12; }
+    std::size_t cpuBytes() const;
 private:
     Colour mColour;
     float mLength;
@@ -196,6 +496,124 @@ private:
 
 
 
+// per-instance vertex data, matches the attributes in instanced.vert
+struct InstanceData
+{
+    glm::vec4 colour;
+    GLuint transform; //slot of the world matrix in the transform buffer
+};
+
+// one indirect draw. Indexed prototypes use the DrawElementsIndirectCommand
+// layout, the others DrawArraysIndirectCommand padded to the same size
+using DrawCommand = std::array<GLuint, 5>;
+
+// many copies of a few prototype objects. Every copy is a node of the
+// transform system below the scene's own node, the shader reads the world
+// matrices straight from the transform buffer. Culling and draw commands
+// are recorded on a thread pool into one command list per worker, the GL
+// thread then uploads the lists and replays them with one multi-draw per
+// prototype
+class InstancedScene : public Object
+{
+public:
+    InstancedScene(ThreadPool& pool, TransformSystem& transforms);
+
+    // returns the node of the new copy, angle is about the y axis. Adding
+    // after loadDataToGPU uploads the whole scene again
+    TransformSystem::Node add(Object& prototype, math::Point position, float angle, float scale, Colour colour);
+
+    // the number of command lists follows the number of workers
+    void setThreadPool(ThreadPool& pool);
+
+    std::vector<Object*> const& prototypes() const { return mPrototypes; }
+
+    void loadDataToGPU();
+
+    void render(RenderContext const& ctx);
+
+    // fills the command lists without touching GL, returns the number of
+    // visible instances
+    std::size_t record(math::Matrix4 const& viewProj);
+
+    void freeGPUData();
+
+    GLsizei elementCount() const { return 0; }
+    std::size_t cpuBytes() const;
+
+private:
+    struct SceneObject
+    {
+        std::uint32_t prototype;
+        TransformSystem::Node node;
+        Colour colour;
+    };
+
+    void recordList(std::size_t list, std::array<glm::vec4, 6> const& planes);
+    void bindPrototype(std::size_t index);
+    void deleteLayout();
+    void buffersReleased(Object const& owner) override;
+
+    ThreadPool* mPool;
+    TransformSystem& mTransformSystem;
+    std::size_t mListCount;
+
+    std::vector<Object*> mPrototypes;
+    std::vector<SceneObject> mObjects; //sorted by prototype once loaded
+
+    // staging for the GPU, list i owns the instances of its object range
+    std::vector<InstanceData> mInstances;
+    std::vector<std::size_t> mListSizes;
+    std::vector<DrawCommand> mCommands; //[prototype][list]
+
+    GLuint mInstanceBuffer{};
+    GLuint mIndirectBuffer{};
+    // one vertex array per prototype, dropped when its buffers are evicted
+    // and rebuilt when they come back
+    std::vector<GLuint> mPrototypeVaos;
+    std::vector<std::uint32_t> mPrototypeGenerations;
+};
+
+
+
+struct ResidencyStats
+{
+    std::size_t residentBytes{0}; //GPU buffers currently allocated
+    std::size_t cpuBytes{0};      //CPU copies currently kept
+    std::size_t evictions{0};
+    std::size_t reuploads{0};
+    std::size_t reuploadBytes{0};
+    double reuploadSeconds{0.0};
+};
+
+// keeps the GPU buffers of all tracked objects within a budget by evicting
+// the ones that have not been visible for the longest time
+class ResidencyManager
+{
+public:
+    ResidencyManager(std::size_t gpuBudget, std::size_t cpuBudget);
+
+    // obj must already be uploaded, its CPU copy is dropped if possible
+    void track(Object& obj);
+
+    // called for every object drawn in frame, streams it back in if it was
+    // evicted, returns true if it had to
+    bool makeResident(Object& obj, std::uint64_t frame);
+
+    ResidencyStats const& stats() const { return mStats; }
+
+private:
+    void evictFor(std::size_t bytes, std::uint64_t frame);
+    // objects visible in frame or later keep their CPU copy
+    void enforceCpuBudget(std::uint64_t frame);
+    void updateCpuBytes();
+
+    // last frame each tracked object was drawn in
+    std::unordered_map<Object*, std::uint64_t> mLastVisible;
+    std::size_t mGpuBudget;
+    std::size_t mCpuBudget;
+    ResidencyStats mStats;
+};
+
 class Program
 {
 public:
@@ -205,14 +623,49 @@ public:
 
     void freeGPUData();
 
+    void setRedrawMode(RedrawMode mode);
+
+    // forces the next loop iteration to draw a new frame
+    void requestRedraw() { mDirty = true; }
+
+    void setFramePacing(FramePacing pacing, double targetFrameRate = 144.0);
+
+    // objects drawn by run() are made resident through this manager
+    void setResidencyManager(ResidencyManager* residency) { mResidency = residency; }
+
+    // drawn instead of the single object while toggled on with B
+    void setScene(InstancedScene* scene) { mScene = scene; }
+
+    // updated at the start of every frame, changes trigger a redraw
+    void setTransforms(TransformSystem* transforms) { mTransforms = transforms; }
+
 private:
     static void errorCallback(int code, char const* message)
     {
         fmt::print("error ({}): {}\n", code, message);
     }
 
+    // called by GLFW when the window contents were damaged (e.g. uncovered)
+    static void refreshCallback([[maybe_unused]] GLFWwindow* window)
+    {
+        sExposed = true;
+    }
+
     void createGLContext();
 
+    bool updateCamera(float dt);
+
+    void applySwapInterval();
+    void waitForNextFrame();
+    void sleepUntil(double wake);
+    void recordFrame(double inputTime, double submitTime, double presentTime);
+
+    void createFrameCache(int width, int height);
+    void freeFrameCache();
+    void presentFrameCache(int width, int height);
+
+    static inline bool sExposed{false};
+
     GLFWwindow* mWindow;
     glx::WindowSettings settings;
     glx::WindowCallbacks callbacks;
@@ -230,4 +683,35 @@ private:
     Directional mDirectional;
     bool mSpecularFlag;
     bool mDirectionalFlag;
+
+    RedrawMode mRedrawMode;
+    bool mDirty;
+
+    FramePacing mFramePacing;
+    double mTargetFrameRate;
+    double mNextFrameDeadline;
+    double mFrameCostEstimate;
+    double mWorkCostEstimate; //input sample to glfwSwapBuffers, without the vsync wait
+    double mRefreshPeriod;    //0 if the monitor does not report its rate
+    double mLastPresent;
+
+    bool mShowStats;
+    FrameStats mStats;
+
+    // offscreen copy of the last frame, only used by RedrawMode::OnDemandCached
+    GLuint mCacheFbo;
+    GLuint mCacheColour;
+    GLuint mCacheDepth;
+    int mCacheWidth;
+    int mCacheHeight;
+
+    FrameArena mArena;
+
+    ResidencyManager* mResidency;
+    std::uint64_t mFrameIndex;
+
+    InstancedScene* mScene;
+    bool mSceneFlag;
+
+    TransformSystem* mTransforms;
 };
@@ -0,0 +1,30 @@
+#version 450 core
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+// per instance, see InstanceData
+layout(location = 2) in uint instanceTransform;
+layout(location = 6) in vec3 instanceColour;
+
+// world matrices of the transform system, indexed by slot
+layout(std430, binding = 0) readonly buffer Transforms
+{
+    mat4 worlds[];
+};
+
+uniform mat4 proj;
+uniform mat4 view;
+
+out vec3 vertexColour;
+out vec3 Normal;
+out vec3 fragPos;
+
+void main()
+{
+    mat4 instanceModel = worlds[instanceTransform];
+    gl_Position =  proj * view * instanceModel * vec4(position, 1.0);
+    fragPos = vec3(instanceModel * vec4(position, 1.0));
+    vertexColour = instanceColour;
+    // instances only use uniform scale, so the model matrix is fine for normals
+    Normal = mat3(instanceModel) * normal;
+}
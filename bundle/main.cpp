@@ -2,7 +2,478 @@
 #include "glm/ext.hpp"
 #include <atlas/utils/LoadObjFile.hpp>
 
-#define CAM_SPEED 0.2f
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#endif
+
+#define CAM_SPEED 3.0f // world units per second
+
+// ===----------ALLOCATION CHECK-------------===
+
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+static std::atomic<std::size_t> allocationCount{0};
+
+std::size_t heapAllocationCount()
+{
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+// replaces the global allocator so that Program::run can tell whether a
+// frame touched the heap
+void* operator new(std::size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, [[maybe_unused]] std::size_t size) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+// ===-------------FRAME ARENA---------------===
+
+FrameArena::FrameArena(std::size_t capacity) :
+    mBuffer{ std::make_unique<std::byte[]>(capacity) }, mCapacity{ capacity }, mOffset{}, mHighWater{}
+{}
+
+void* FrameArena::allocate(std::size_t bytes, std::size_t alignment)
+{
+    std::size_t start = (mOffset + alignment - 1) & ~(alignment - 1);
+    if (start + bytes > mCapacity)
+    {
+        throw FrameAllocationError(fmt::format(
+            "frame arena exhausted: {} bytes requested, {} of {} in use", bytes, mOffset, mCapacity));
+    }
+
+    mOffset = start + bytes;
+    mHighWater = std::max(mHighWater, mOffset);
+    return mBuffer.get() + start;
+}
+
+void FrameArena::reset()
+{
+    mOffset = 0;
+}
+
+// ===--------------TRANSFORMS---------------===
+
+TransformSystem::TransformSystem(ThreadPool& pool) :
+    mPool{ pool }, mOrderDirty{ false }, mRecomputed{}
+{}
+
+TransformSystem::Node TransformSystem::add(Node parent, math::Point translation, glm::quat rotation, math::Vector scale)
+{
+    if (parent != NoParent && parent >= mSlot.size())
+    {
+        throw std::out_of_range(fmt::format("transform parent {} does not exist", parent));
+    }
+
+    // appended for now, update() moves it below its parent
+    auto node = static_cast<Node>(mSlot.size());
+    auto slot = static_cast<std::uint32_t>(mNode.size());
+    mParentNode.push_back(parent);
+    mSlot.push_back(slot);
+
+    mNode.push_back(node);
+    mParent.push_back(parent == NoParent ? NoParent : mSlot[parent]);
+    mSubtreeEnd.push_back(slot + 1);
+    mTx.push_back(translation.x);
+    mTy.push_back(translation.y);
+    mTz.push_back(translation.z);
+    mQx.push_back(rotation.x);
+    mQy.push_back(rotation.y);
+    mQz.push_back(rotation.z);
+    mQw.push_back(rotation.w);
+    mSx.push_back(scale.x);
+    mSy.push_back(scale.y);
+    mSz.push_back(scale.z);
+    mDirty.push_back(0);
+    mWorld.emplace_back(1.0f);
+
+    if (parent != NoParent)
+    {
+        mOrderDirty = true;
+    }
+    markDirty(slot);
+    return node;
+}
+
+void TransformSystem::setTranslation(Node node, math::Point translation)
+{
+    std::size_t slot = mSlot[node];
+    mTx[slot] = translation.x;
+    mTy[slot] = translation.y;
+    mTz[slot] = translation.z;
+    markDirty(slot);
+}
+
+void TransformSystem::setRotation(Node node, glm::quat rotation)
+{
+    std::size_t slot = mSlot[node];
+    mQx[slot] = rotation.x;
+    mQy[slot] = rotation.y;
+    mQz[slot] = rotation.z;
+    mQw[slot] = rotation.w;
+    markDirty(slot);
+}
+
+void TransformSystem::setScale(Node node, math::Vector scale)
+{
+    std::size_t slot = mSlot[node];
+    mSx[slot] = scale.x;
+    mSy[slot] = scale.y;
+    mSz[slot] = scale.z;
+    markDirty(slot);
+}
+
+void TransformSystem::markDirty(std::size_t slot)
+{
+    if (!mDirty[slot])
+    {
+        mDirty[slot] = 1;
+        mDirtySlots.push_back(static_cast<std::uint32_t>(slot));
+    }
+}
+
+void TransformSystem::sortDepthFirst()
+{
+    std::size_t count = mNode.size();
+
+    // children of every node, in the order they were added
+    std::vector<std::uint32_t> firstChild(count + 1, 0);
+    for (Node parent : mParentNode)
+    {
+        if (parent != NoParent)
+        {
+            ++firstChild[parent + 1];
+        }
+    }
+    for (std::size_t i{0}; i < count; ++i)
+    {
+        firstChild[i + 1] += firstChild[i];
+    }
+    std::vector<Node> children(firstChild[count]);
+    std::vector<std::uint32_t> fill(firstChild.begin(), firstChild.end() - 1);
+    for (Node node{0}; node < count; ++node)
+    {
+        if (mParentNode[node] != NoParent)
+        {
+            children[fill[mParentNode[node]]++] = node;
+        }
+    }
+
+    // preorder walk from every root, children pushed in reverse so they come
+    // out in the order they were added
+    std::vector<Node> order;
+    order.reserve(count);
+    std::vector<Node> stack;
+    for (Node root{0}; root < count; ++root)
+    {
+        if (mParentNode[root] != NoParent)
+        {
+            continue;
+        }
+        stack.push_back(root);
+        while (!stack.empty())
+        {
+            Node node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (auto i = firstChild[node + 1]; i > firstChild[node]; --i)
+            {
+                stack.push_back(children[i - 1]);
+            }
+        }
+    }
+
+    auto permute = [&](auto& values) {
+        std::remove_reference_t<decltype(values)> sorted;
+        sorted.reserve(count);
+        for (Node node : order)
+        {
+            sorted.push_back(values[mSlot[node]]);
+        }
+        values.swap(sorted);
+    };
+    permute(mTx);
+    permute(mTy);
+    permute(mTz);
+    permute(mQx);
+    permute(mQy);
+    permute(mQz);
+    permute(mQw);
+    permute(mSx);
+    permute(mSy);
+    permute(mSz);
+    permute(mDirty);
+    permute(mWorld);
+
+    for (std::size_t slot{0}; slot < count; ++slot)
+    {
+        mSlot[order[slot]] = static_cast<std::uint32_t>(slot);
+    }
+    for (std::size_t slot{0}; slot < count; ++slot)
+    {
+        Node parent = mParentNode[order[slot]];
+        mParent[slot] = parent == NoParent ? NoParent : mSlot[parent];
+        mSubtreeEnd[slot] = static_cast<std::uint32_t>(slot + 1);
+    }
+    // children come after their parent, so walking backwards sees every
+    // subtree complete before it is added to its parent
+    for (std::size_t slot = count; slot-- > 0;)
+    {
+        if (mParent[slot] != NoParent)
+        {
+            mSubtreeEnd[mParent[slot]] = std::max(mSubtreeEnd[mParent[slot]], mSubtreeEnd[slot]);
+        }
+    }
+    mNode = std::move(order);
+
+    mDirtySlots.clear();
+    for (std::size_t slot{0}; slot < count; ++slot)
+    {
+        if (mDirty[slot])
+        {
+            mDirtySlots.push_back(static_cast<std::uint32_t>(slot));
+        }
+    }
+    mOrderDirty = false;
+}
+
+bool TransformSystem::update()
+{
+    bool resorted = mOrderDirty;
+    if (resorted)
+    {
+        sortDepthFirst();
+    }
+
+    mChanged.clear();
+    mRecomputed = 0;
+    if (mDirtySlots.empty())
+    {
+        return false;
+    }
+
+    // only the topmost changed nodes matter, everything below them is
+    // recomputed with them. The subtrees left over do not overlap
+    std::sort(mDirtySlots.begin(), mDirtySlots.end());
+    std::size_t covered{0};
+    for (std::uint32_t slot : mDirtySlots)
+    {
+        if (slot >= covered)
+        {
+            covered = mSubtreeEnd[slot];
+            mChanged.emplace_back(slot, covered);
+            mRecomputed += covered - slot;
+        }
+        mDirty[slot] = 0;
+    }
+    mDirtySlots.clear();
+
+    parallelFor(mPool, mChanged.size(), SubtreesPerTask, [this](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            updateSubtree(mChanged[i].first);
+        }
+    });
+
+    if (resorted)
+    {
+        // every slot may have moved
+        mChanged.assign(1, { 0, mNode.size() });
+    }
+
+    // kept until the next upload(), which may be several updates away
+    mUploadRanges.insert(mUploadRanges.end(), mChanged.begin(), mChanged.end());
+    if (mUploadRanges.size() > MaxUploadRanges)
+    {
+        std::size_t first = mUploadRanges.front().first;
+        std::size_t last = mUploadRanges.front().second;
+        for (auto [begin, end] : mUploadRanges)
+        {
+            first = std::min(first, begin);
+            last = std::max(last, end);
+        }
+        mUploadRanges.assign(1, { first, last });
+    }
+    return true;
+}
+
+void TransformSystem::updateSubtree(std::size_t root)
+{
+    std::size_t end = mSubtreeEnd[root];
+    if (end - root <= SubtreeSplitSize)
+    {
+        computeRange(root, end);
+        return;
+    }
+
+    // the children only depend on the root, so once it is done the child
+    // subtrees can go in parallel. Small neighbouring ones are batched
+    computeRange(root, root + 1);
+    auto range = [](void* self, std::size_t begin, std::size_t end) {
+        static_cast<TransformSystem*>(self)->computeRange(begin, end);
+    };
+    auto subtree = [](void* self, std::size_t root, std::size_t) {
+        static_cast<TransformSystem*>(self)->updateSubtree(root);
+    };
+    TaskGroup group{mPool};
+    std::size_t batch = root + 1;
+    for (std::size_t child = root + 1; child < end; child = mSubtreeEnd[child])
+    {
+        std::size_t childEnd = mSubtreeEnd[child];
+        if (childEnd - child > SubtreeSplitSize)
+        {
+            if (batch < child)
+            {
+                group.run(range, this, batch, child);
+            }
+            group.run(subtree, this, child);
+            batch = childEnd;
+        }
+        else if (childEnd - batch >= SubtreeSplitSize)
+        {
+            group.run(range, this, batch, childEnd);
+            batch = childEnd;
+        }
+    }
+    if (batch < end)
+    {
+        computeRange(batch, end);
+    }
+    group.wait();
+}
+
+void TransformSystem::computeRange(std::size_t begin, std::size_t end)
+{
+    // the local matrices of a batch are built into small arrays first, that
+    // loop has no branches or dependencies between nodes so it vectorizes.
+    // Multiplying by the parent has to follow in slot order
+    float local[12][TransformBatch];
+    for (std::size_t first = begin; first < end; first += TransformBatch)
+    {
+        std::size_t count = std::min(TransformBatch, end - first);
+        float const* tx = mTx.data() + first;
+        float const* ty = mTy.data() + first;
+        float const* tz = mTz.data() + first;
+        float const* qx = mQx.data() + first;
+        float const* qy = mQy.data() + first;
+        float const* qz = mQz.data() + first;
+        float const* qw = mQw.data() + first;
+        float const* sx = mSx.data() + first;
+        float const* sy = mSy.data() + first;
+        float const* sz = mSz.data() + first;
+
+        for (std::size_t i{0}; i < count; ++i)
+        {
+            float xx = qx[i] * qx[i], yy = qy[i] * qy[i], zz = qz[i] * qz[i];
+            float xy = qx[i] * qy[i], xz = qx[i] * qz[i], yz = qy[i] * qz[i];
+            float wx = qw[i] * qx[i], wy = qw[i] * qy[i], wz = qw[i] * qz[i];
+
+            local[0][i] = (1.0f - 2.0f * (yy + zz)) * sx[i];
+            local[1][i] = 2.0f * (xy + wz) * sx[i];
+            local[2][i] = 2.0f * (xz - wy) * sx[i];
+            local[3][i] = 2.0f * (xy - wz) * sy[i];
+            local[4][i] = (1.0f - 2.0f * (xx + zz)) * sy[i];
+            local[5][i] = 2.0f * (yz + wx) * sy[i];
+            local[6][i] = 2.0f * (xz + wy) * sz[i];
+            local[7][i] = 2.0f * (yz - wx) * sz[i];
+            local[8][i] = (1.0f - 2.0f * (xx + yy)) * sz[i];
+            local[9][i] = tx[i];
+            local[10][i] = ty[i];
+            local[11][i] = tz[i];
+        }
+
+        for (std::size_t i{0}; i < count; ++i)
+        {
+            math::Matrix4 model{ local[0][i], local[1][i], local[2][i], 0.0f,
+                                 local[3][i], local[4][i], local[5][i], 0.0f,
+                                 local[6][i], local[7][i], local[8][i], 0.0f,
+                                 local[9][i], local[10][i], local[11][i], 1.0f };
+            std::size_t slot = first + i;
+            std::uint32_t parent = mParent[slot];
+            mWorld[slot] = parent == NoParent ? model : mWorld[parent] * model;
+        }
+    }
+}
+
+std::size_t TransformSystem::upload()
+{
+    // nodes were added, everything goes into a new buffer
+    if (mBufferSlots < mWorld.size())
+    {
+        glDeleteBuffers(1, &mBuffer);
+        glCreateBuffers(1, &mBuffer);
+        glNamedBufferStorage(mBuffer, mWorld.size() * sizeof(math::Matrix4), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        mBufferSlots = mWorld.size();
+        mUploadRanges.assign(1, { 0, mWorld.size() });
+    }
+    if (mUploadRanges.empty())
+    {
+        return 0;
+    }
+
+    // ranges from different updates can overlap, merge them along with the
+    // ones that are close together so fewer calls are needed
+    std::sort(mUploadRanges.begin(), mUploadRanges.end());
+    std::size_t merged{0};
+    for (std::size_t i{1}; i < mUploadRanges.size(); ++i)
+    {
+        if (mUploadRanges[i].first <= mUploadRanges[merged].second + UploadMergeGap)
+        {
+            mUploadRanges[merged].second = std::max(mUploadRanges[merged].second, mUploadRanges[i].second);
+        }
+        else
+        {
+            mUploadRanges[++merged] = mUploadRanges[i];
+        }
+    }
+    mUploadRanges.resize(merged + 1);
+
+    std::size_t bytes{0};
+    for (auto [begin, end] : mUploadRanges)
+    {
+        auto size = static_cast<GLsizeiptr>((end - begin) * sizeof(math::Matrix4));
+        glNamedBufferSubData(mBuffer, static_cast<GLintptr>(begin * sizeof(math::Matrix4)), size, &mWorld[begin]);
+        bytes += size;
+    }
+    mUploadRanges.clear();
+    return bytes;
+}
+
+void TransformSystem::freeGPUData()
+{
+    glDeleteBuffers(1, &mBuffer);
+    mBuffer = 0;
+    mBufferSlots = 0;
+}
 
 // ===---------------OBJECT-----------------===
 
@@ -10,7 +481,7 @@ void Object::loadShaders()
 {
     std::string shaderRoot{ ShaderPath };
     vertexSource =
-        glx::readShaderSource(shaderRoot + "triangle.vert", IncludeDir);
+        glx::readShaderSource(shaderRoot + mVertexShaderFile, IncludeDir);
     fragmentSource =
         glx::readShaderSource(shaderRoot + "triangle.frag", IncludeDir);
 
@@ -38,27 +509,67 @@ void Object::loadShaders()
     setupUniformVariables();
 }
 
-void Object::reloadShaders()
+bool Object::reloadShaders()
 {
+    bool reloaded{false};
+
     if (glx::shouldShaderBeReloaded(vertexSource))
     {
         glx::reloadShader(
             mProgramHandle, mVertHandle, vertexSource, IncludeDir);
+        reloaded = true;
     }
 
     if (glx::shouldShaderBeReloaded(fragmentSource))
     {
         glx::reloadShader(
             mProgramHandle, mFragHandle, fragmentSource, IncludeDir);
+        reloaded = true;
+    }
+
+    if (reloaded)
+    {
+        mDirty = true;
     }
+    return reloaded;
 }
 
-void Object::freeGPUData()
+void Object::releaseBuffers()
 {
-    // unwind all the allocations made
+    for (Object* user : mBufferUsers)
+    {
+        user->buffersReleased(*this);
+    }
+    mBufferGeneration++;
+
     glDeleteVertexArrays(1, &mVao);
     glDeleteBuffers(1, &mVbo);
     glDeleteBuffers(1, &mEbo);
+    mVao = 0;
+    mVbo = 0;
+    mEbo = 0;
+}
+
+void Object::addBufferUser(Object& user)
+{
+    mBufferUsers.push_back(&user);
+}
+
+void Object::removeBufferUser(Object& user)
+{
+    mBufferUsers.erase(std::remove(mBufferUsers.begin(), mBufferUsers.end(), &user), mBufferUsers.end());
+}
+
+std::size_t Object::restream()
+{
+    loadDataToGPU();
+    return mGpuBytes;
+}
+
+void Object::freeGPUData()
+{
+    // unwind all the allocations made
+    releaseBuffers();
     glDeleteShader(mFragHandle);
     glDeleteShader(mVertHandle);
     glDeleteProgram(mProgramHandle);
@@ -80,29 +591,72 @@ void Object::setupUniformVariables()
     mUniformDirectionalFlagLoc = glGetUniformLocation(mProgramHandle, "directionalFlag");
 }
 
+std::uint64_t Object::sortKey() const
+{
+    return (static_cast<std::uint64_t>(mProgramHandle) << 32) | mVao;
+}
+
+void Object::setTransform(TransformSystem const& transforms, TransformSystem::Node node)
+{
+    mTransforms = &transforms;
+    mTransformNode = node;
+    mDirty = true;
+}
+
+math::Matrix4 const& Object::modelMatrix() const
+{
+    static const math::Matrix4 identity{1.0f};
+    return mTransforms != nullptr ? mTransforms->world(mTransformNode) : identity;
+}
+
+void Object::bindUniforms(RenderContext const& ctx, math::Matrix4 const& modelMat, Colour const& colour)
+{
+    // tell OpenGL which program object to use to render the Triangle
+    glUseProgram(mProgramHandle);
+
+    // **************************************
+    // bind matrices to memory
+    // **************************************
+
+    glUniformMatrix4fv(mUniformProjectionLoc, 1, GL_FALSE, glm::value_ptr(ctx.projMat)); //do this 3 times, once per uniform variable
+    glUniformMatrix4fv(mUniformViewLoc, 1, GL_FALSE, glm::value_ptr(ctx.viewMat));
+    glUniformMatrix4fv(mUniformModelLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
+    glUniform3fv(mUniformColourLoc, 1, glm::value_ptr(colour));
+    glUniform3fv(mUniformAmbientLoc, 1, glm::value_ptr(ctx.ambient));
+    glUniform3fv(mUniformPointLightPosLoc, 1, glm::value_ptr(ctx.pointLight.mPos));
+    glUniform3fv(mUniformPointLightColLoc, 1, glm::value_ptr(ctx.pointLight.L()));
+    glUniform3fv(mUniformCameraPosLoc, 1, glm::value_ptr(ctx.camera.mEye));
+    glUniform3fv(mUniformDirectionalDirLoc, 1, glm::value_ptr(ctx.directional.mDir));
+    glUniform3fv(mUniformDirectionalColLoc, 1, glm::value_ptr(ctx.directional.L()));
+    glUniform1i(mUniformSpecularFlagLoc, (GLint)ctx.specularFlag);
+    glUniform1i(mUniformDirectionalFlagLoc, (GLint)ctx.directionalFlag);
+}
+
 // ===---------------MESH-----------------===
 
-Mesh::Mesh(atlas::utils::ObjMesh mesh, Colour colour) :
-     mColour{colour}
+// the cache stores indices as std::uint32_t and they are uploaded as GLuint
+static_assert(std::is_same_v<GLuint, std::uint32_t>);
+
+Mesh::Mesh(MeshData data, Colour colour, std::string cachePath) :
+     mColour{colour}, mVertices{std::move(data.vertices)}, mIndices{std::move(data.indices)},
+     mIndexCount{}, mCachePath{std::move(cachePath)}
 {
     mProgramHandle = glCreateProgram();
     mVertHandle = glCreateShader(GL_VERTEX_SHADER);
     mFragHandle = glCreateShader(GL_FRAGMENT_SHADER);
-    
-    std::vector<SimpleVertex> sVertices;
-    std::vector<GLuint> sIndices;
 
-    for (atlas::utils::Vertex v : mesh.shapes[0].vertices) {
-        SimpleVertex sV;
-        sV.position = v.position;
-        sV.normal = v.normal;
-        sVertices.push_back(sV);
-    }
-    for (size_t i : mesh.shapes[0].indices) {
-        sIndices.push_back((GLuint)i);
+    measure();
+}
+
+Mesh::Mesh(atlas::utils::ObjMesh mesh, Colour colour, std::string cachePath) :
+    Mesh{meshDataFromObj(mesh), colour, std::move(cachePath)}
+{
+    if (!mCachePath.empty() && !writeMeshCache(mCachePath, MeshData{mVertices, mIndices}))
+    {
+        // without a cache the CPU copy has to stay around
+        fmt::print("warning: could not write mesh cache {}\n", mCachePath);
+        mCachePath.clear();
     }
-    mVertices = sVertices;
-    mIndices = sIndices;
 }
 
 
@@ -121,6 +675,8 @@ void Mesh::loadDataToGPU() {
     glNamedBufferStorage(
         mEbo, mIndices.size() * sizeof(GLuint), mIndices.data(), 0);
 
+    mGpuBytes = mVertices.size() * sizeof(SimpleVertex) + mIndices.size() * sizeof(GLuint);
+
 
     // bind vertex buffer to the vertex array
     glVertexArrayVertexBuffer(mVao, 0, mVbo, 0, glx::stride<float>(6));
@@ -145,56 +701,66 @@ void Mesh::loadDataToGPU() {
 
 }
 
-void Mesh::render([[maybe_unused]] bool paused,
-    [[maybe_unused]] int width,
-    [[maybe_unused]] int height,
-    Camera cam, glm::vec3 ambient, PointLight pointLight, Directional directional, bool specularFlag, bool directionalFlag)
+void Mesh::measure()
 {
-    reloadShaders();
-
-    // **************************************
-    // assign values to MVP matrices
-    // **************************************
+    mIndexCount = static_cast<GLsizei>(mIndices.size());
+    mBoundingRadius = 0.0f;
+    for (SimpleVertex const& v : mVertices) {
+        mBoundingRadius = std::max(mBoundingRadius, glm::length(v.position));
+    }
+}
 
-    //glm::perspective for pinhole, research other ones
-    auto projMat{ glm::perspective(glm::radians(60.0f), static_cast<float> (width) / (height), nearVal, farVal) };
+std::size_t Mesh::cpuBytes() const
+{
+    return mVertices.capacity() * sizeof(SimpleVertex) + mIndices.capacity() * sizeof(GLuint);
+}
 
-    // if we wanted to change the camera it would be here
-    // giving camera in world space, so if we wanted to move it we would want to move the camera in camera space
-    auto viewMat{ glm::lookAt(cam.mEye, cam.mEye + cam.mCentre, cam.mUp) };
+std::size_t Mesh::restream()
+{
+    if (mVertices.empty())
+    {
+        auto data = readMeshCache(mCachePath);
+        if (!data)
+        {
+            throw MeshCacheError("Failed to read mesh cache " + mCachePath);
+        }
+        mVertices = std::move(data->vertices);
+        mIndices = std::move(data->indices);
+        // assetc may have rewritten the cache since it was last read
+        measure();
+    }
 
-    //need 4x4 matrix as first argument
-    // M*V*P is the transformation matrix 
-    auto modelMat{ math::Matrix4{1.0f}}; 
+    loadDataToGPU();
+    return mGpuBytes;
+}
 
-    // tell OpenGL which program object to use to render the Triangle
-    glUseProgram(mProgramHandle);
+bool Mesh::canDropCPUData() const
+{
+    return !mCachePath.empty() && !mVertices.empty();
+}
 
-    // **************************************
-    // bind matrices to memory
-    // **************************************
+void Mesh::dropCPUData()
+{
+    if (!canDropCPUData())
+    {
+        return;
+    }
 
-    glUniformMatrix4fv(mUniformProjectionLoc, 1, GL_FALSE, glm::value_ptr(projMat)); //do this 3 times, once per uniform variable
-    glUniformMatrix4fv(mUniformViewLoc, 1, GL_FALSE, glm::value_ptr(viewMat));
-    glUniformMatrix4fv(mUniformModelLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniform3fv(mUniformColourLoc, 1, glm::value_ptr(mColour));
-    glUniform3fv(mUniformAmbientLoc, 1, glm::value_ptr(ambient));
-    glUniform3fv(mUniformPointLightPosLoc, 1, glm::value_ptr(pointLight.mPos));
-    glUniform3fv(mUniformPointLightColLoc, 1, glm::value_ptr(pointLight.L()));
-    glUniform3fv(mUniformCameraPosLoc, 1, glm::value_ptr(cam.mEye));
-    glUniform3fv(mUniformDirectionalDirLoc, 1, glm::value_ptr(directional.mDir));
-    glUniform3fv(mUniformDirectionalColLoc, 1, glm::value_ptr(directional.L()));
-    glUniform1i(mUniformSpecularFlagLoc, (GLint)specularFlag);
-    glUniform1i(mUniformDirectionalFlagLoc, (GLint)directionalFlag);
+    // swap with empty vectors so the memory is actually returned
+    std::vector<SimpleVertex>{}.swap(mVertices);
+    std::vector<GLuint>{}.swap(mIndices);
+}
 
+void Mesh::render(RenderContext const& ctx)
+{
+    // M*V*P is the transformation matrix, M comes from the transform system
+    bindUniforms(ctx, modelMatrix(), mColour);
 
     // tell OpenGL which vertex array object to use to render the Triangle
     glBindVertexArray(mVao);
     // actually render the Triangle
-    int size; 
-    glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
-    glDrawElements(GL_TRIANGLES, size/sizeof(GLuint), GL_UNSIGNED_INT, 0 ); //(mode, starting index in enabled arrays, number of vertexes to be rendered)
-
+    glDrawElements(GL_TRIANGLES, mIndexCount, GL_UNSIGNED_INT, 0 ); //(mode, starting index in enabled arrays, number of vertexes to be rendered)
+    glBindVertexArray(0);
 }
 
 
@@ -210,6 +776,7 @@ Cube::Cube(float length, Colour colour)
 
     mColour = colour;
     mLength = length;
+    mBoundingRadius = mLength * std::sqrt(3.0f);
 
     std::array<float, 18*12> vertices{ //12 triangles each take 18 bytes
         // Vertices                     /Normals
@@ -278,6 +845,7 @@ void Cube::loadDataToGPU()
     // allocate and initialize buffer to vertex data
     glNamedBufferStorage(
         mVbo, glx::size<float>(mVertices.size()), mVertices.data(), 0);
+    mGpuBytes = glx::size<float>(mVertices.size());
 
     // create holder for all buffers
     glCreateVertexArrays(1, &mVao);
@@ -302,66 +870,289 @@ void Cube::loadDataToGPU()
 
 
 
-void Cube::render([[maybe_unused]] bool paused,
-    [[maybe_unused]] int width,
-    [[maybe_unused]] int height,
-    Camera cam, glm::vec3 ambient, PointLight pointLight, Directional directional, bool specularFlag, bool directionalFlag)
+std::size_t Cube::cpuBytes() const
 {
-    reloadShaders();
+    return sizeof(mVertices);
+}
 
-    // **************************************
-    // assign values to MVP matrices
-    // **************************************
+void Cube::render(RenderContext const& ctx)
+{
+    // M*V*P is the transformation matrix, M comes from the transform system
+    bindUniforms(ctx, modelMatrix(), mColour);
 
+    // tell OpenGL which vertex array object to use to render the Triangle
+    glBindVertexArray(mVao);
+    // actually render the Triangle
+    glDrawArrays(GL_TRIANGLES, 0, 3*12); //(mode, starting index in enabled arrays, number of vertexes to be rendered)
+    glBindVertexArray(0);
+}
 
+// ===-----------INSTANCED SCENE-------------===
 
-    //glm::perspective for pinhole, research other ones
-    auto projMat{ glm::perspective(glm::radians(60.0f), static_cast<float> (width) / (height), nearVal, farVal) };
+InstancedScene::InstancedScene(ThreadPool& pool, TransformSystem& transforms) :
+    mPool{ &pool }, mTransformSystem{ transforms }, mListCount{ pool.threadCount() }
+{
+    setTransform(transforms, transforms.add(TransformSystem::NoParent));
 
-    // if we wanted to change the camera it would be here
-    // giving camera in world space, so if we wanted to move it we would want to move the camera in camera space
-    auto viewMat{ glm::lookAt(cam.mEye, cam.mEye + cam.mCentre, cam.mUp) };
+    mProgramHandle = glCreateProgram();
+    mVertHandle = glCreateShader(GL_VERTEX_SHADER);
+    mFragHandle = glCreateShader(GL_FRAGMENT_SHADER);
+    mVertexShaderFile = "instanced.vert";
+}
 
-    //if (!paused) {
-    //    // change value of position
-    //    //position = static_cast<float>(glfwGetTime()) * 64.0f;
-    //    if (position >= 360.0f) {
-    //        position = 0.0f;
-    //    }
-    //    position += 1.0f;
+TransformSystem::Node InstancedScene::add(Object& prototype, math::Point position, float angle, float scale, Colour colour)
+{
+    auto it = std::find(mPrototypes.begin(), mPrototypes.end(), &prototype);
+    if (it == mPrototypes.end()) {
+        it = mPrototypes.insert(mPrototypes.end(), &prototype);
+        prototype.addBufferUser(*this);
+    }
 
-    //}
+    auto index = static_cast<std::uint32_t>(it - mPrototypes.begin());
+    auto node = mTransformSystem.add(mTransformNode, position,
+        glm::angleAxis(angle, glm::vec3{ 0.0f, 1.0f, 0.0f }), math::Vector{ scale });
+    mObjects.push_back(SceneObject{ index, node, colour });
+    mDirty = true;
+
+    // the staging vectors and buffers are sized for the objects present at
+    // upload, so a later copy needs the whole layout redone
+    if (mInstanceBuffer != 0) {
+        deleteLayout();
+        loadDataToGPU();
+    }
+    return node;
+}
 
-    //need 4x4 matrix as first argument
-    // M*V*P is the transformation matrix 
-    auto modelMat{ glm::rotate(math::Matrix4{1.0f}, glm::radians(0.0f), glm::vec3{0.0f, 1.0f, 0.0f}) }; //use position here!
+void InstancedScene::setThreadPool(ThreadPool& pool)
+{
+    mPool = &pool;
+    mListCount = pool.threadCount();
+    mListSizes.assign(mListCount, 0);
+    mCommands.assign(mPrototypes.size() * mListCount, DrawCommand{});
+
+    if (mIndirectBuffer != 0) {
+        glDeleteBuffers(1, &mIndirectBuffer);
+        glCreateBuffers(1, &mIndirectBuffer);
+        glNamedBufferStorage(mIndirectBuffer, mCommands.size() * sizeof(DrawCommand), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    }
+}
 
-    // tell OpenGL which program object to use to render the Triangle
-    glUseProgram(mProgramHandle);
+void InstancedScene::loadDataToGPU()
+{
+    // every command list then covers at most one run per prototype
+    std::stable_sort(mObjects.begin(), mObjects.end(),
+        [](SceneObject const& a, SceneObject const& b) { return a.prototype < b.prototype; });
 
-    // **************************************
-    // bind matrices to memory
-    // **************************************
+    mInstances.resize(mObjects.size());
+    setThreadPool(*mPool);
 
-    glUniformMatrix4fv(mUniformProjectionLoc, 1, GL_FALSE, glm::value_ptr(projMat)); //do this 3 times, once per uniform variable
-    glUniformMatrix4fv(mUniformViewLoc, 1, GL_FALSE, glm::value_ptr(viewMat));
-    glUniformMatrix4fv(mUniformModelLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniform3fv(mUniformColourLoc, 1, glm::value_ptr(mColour));
-    glUniform3fv(mUniformAmbientLoc, 1, glm::value_ptr(ambient));
-    glUniform3fv(mUniformPointLightPosLoc, 1, glm::value_ptr(pointLight.mPos));
-    glUniform3fv(mUniformPointLightColLoc, 1, glm::value_ptr(pointLight.L()));
-    glUniform3fv(mUniformCameraPosLoc, 1, glm::value_ptr(cam.mEye));
-    glUniform3fv(mUniformDirectionalDirLoc, 1, glm::value_ptr(directional.mDir));
-    glUniform3fv(mUniformDirectionalColLoc, 1, glm::value_ptr(directional.L()));
-    glUniform1i(mUniformSpecularFlagLoc, (GLint) specularFlag);
-    glUniform1i(mUniformDirectionalFlagLoc, (GLint) directionalFlag);
+    glCreateBuffers(1, &mInstanceBuffer);
+    glNamedBufferStorage(mInstanceBuffer, mInstances.size() * sizeof(InstanceData), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &mIndirectBuffer);
+    glNamedBufferStorage(mIndirectBuffer, mCommands.size() * sizeof(DrawCommand), nullptr, GL_DYNAMIC_STORAGE_BIT);
 
+    mPrototypeVaos.assign(mPrototypes.size(), 0);
+    mPrototypeGenerations.assign(mPrototypes.size(), 0);
+    mGpuBytes = mInstances.size() * sizeof(InstanceData) + mCommands.size() * sizeof(DrawCommand);
+}
 
-    // tell OpenGL which vertex array object to use to render the Triangle
-    glBindVertexArray(mVao);
-    // actually render the Triangle
-    glDrawArrays(GL_TRIANGLES, 0, 3*12); //(mode, starting index in enabled arrays, number of vertexes to be rendered)
+std::size_t InstancedScene::record(math::Matrix4 const& viewProj)
+{
+    // frustum planes (Gribb & Hartmann), normalized so the distance to a
+    // sphere centre can be compared against its radius
+    std::array<glm::vec4, 6> planes;
+    for (int i{0}; i < 3; ++i) {
+        glm::vec4 row{ viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i] };
+        glm::vec4 last{ viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3] };
+        planes[2 * i] = last + row;
+        planes[2 * i + 1] = last - row;
+    }
+    for (glm::vec4& plane : planes) {
+        plane = plane * (1.0f / glm::length(glm::vec3{ plane.x, plane.y, plane.z }));
+    }
+
+    // one task per command list, the calling thread helps
+    parallelFor(*mPool, mListCount, 1, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t list{ begin }; list < end; ++list) {
+            recordList(list, planes);
+        }
+    });
+
+    std::size_t visible{ 0 };
+    for (std::size_t size : mListSizes) {
+        visible += size;
+    }
+    return visible;
+}
+
+void InstancedScene::recordList(std::size_t list, std::array<glm::vec4, 6> const& planes)
+{
+    std::size_t begin = list * mObjects.size() / mListCount;
+    std::size_t end = (list + 1) * mObjects.size() / mListCount;
+
+    for (std::size_t p{ 0 }; p < mPrototypes.size(); ++p) {
+        mCommands[p * mListCount + list] = DrawCommand{};
+    }
+
+    std::size_t out{ begin };
+    for (std::size_t i{ begin }; i < end; ++i) {
+        SceneObject const& object = mObjects[i];
+        Object const& prototype = *mPrototypes[object.prototype];
+
+        // the largest axis scale of the world matrix bounds the sphere
+        math::Matrix4 const& world = mTransformSystem.world(object.node);
+        auto squared = [](glm::vec4 const& axis) { return axis.x * axis.x + axis.y * axis.y + axis.z * axis.z; };
+        float scale = std::sqrt(std::max({ squared(world[0]), squared(world[1]), squared(world[2]) }));
+        float radius = prototype.boundingRadius() * scale;
+        glm::vec4 const& centre = world[3];
+        bool inside{ true };
+        for (glm::vec4 const& plane : planes) {
+            if (plane.x * centre.x + plane.y * centre.y + plane.z * centre.z + plane.w < -radius) {
+                inside = false;
+                break;
+            }
+        }
+        if (!inside) {
+            continue;
+        }
+
+        InstanceData& instance = mInstances[out];
+        instance.colour = glm::vec4{ object.colour, 1.0f };
+        instance.transform = static_cast<GLuint>(mTransformSystem.slot(object.node));
+
+        // the objects are sorted, so the first visible one of a prototype starts its run
+        DrawCommand& command = mCommands[object.prototype * mListCount + list];
+        if (command[1] == 0) {
+            auto baseInstance = static_cast<GLuint>(out);
+            command = prototype.indexBuffer() != 0
+                ? DrawCommand{ static_cast<GLuint>(prototype.elementCount()), 0, 0, 0, baseInstance }
+                : DrawCommand{ static_cast<GLuint>(prototype.elementCount()), 0, 0, baseInstance, 0 };
+        }
+        command[1]++;
+        out++;
+    }
+
+    mListSizes[list] = out - begin;
+}
+
+void InstancedScene::bindPrototype(std::size_t index)
+{
+    Object const& prototype = *mPrototypes[index];
+    GLuint& vao = mPrototypeVaos[index];
+
+    glDeleteVertexArrays(1, &vao);
+    glCreateVertexArrays(1, &vao);
+
+    // per-vertex data straight from the prototype's buffers
+    glVertexArrayVertexBuffer(vao, 0, prototype.vertexBuffer(), 0, glx::stride<float>(6));
+    if (prototype.indexBuffer() != 0) {
+        glVertexArrayElementBuffer(vao, prototype.indexBuffer());
+    }
+    glEnableVertexArrayAttrib(vao, 0);
+    glEnableVertexArrayAttrib(vao, 1);
+    glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, glx::relativeOffset<float>(0));
+    glVertexArrayAttribFormat(vao, 1, 3, GL_FLOAT, GL_FALSE, glx::relativeOffset<float>(3));
+    glVertexArrayAttribBinding(vao, 0, 0);
+    glVertexArrayAttribBinding(vao, 1, 0);
+
+    // per-instance slot in the transform buffer and colour
+    glVertexArrayVertexBuffer(vao, 1, mInstanceBuffer, 0, sizeof(InstanceData));
+    glVertexArrayBindingDivisor(vao, 1, 1);
+    glEnableVertexArrayAttrib(vao, 2);
+    glVertexArrayAttribIFormat(vao, 2, 1, GL_UNSIGNED_INT, offsetof(InstanceData, transform));
+    glVertexArrayAttribBinding(vao, 2, 1);
+    glEnableVertexArrayAttrib(vao, 6);
+    glVertexArrayAttribFormat(vao, 6, 3, GL_FLOAT, GL_FALSE, offsetof(InstanceData, colour));
+    glVertexArrayAttribBinding(vao, 6, 1);
+
+    mPrototypeGenerations[index] = prototype.bufferGeneration();
+}
+
+void InstancedScene::buffersReleased(Object const& owner)
+{
+    // the vertex array is the last thing holding on to the evicted buffers
+    for (std::size_t p{ 0 }; p < mPrototypes.size() && p < mPrototypeVaos.size(); ++p) {
+        if (mPrototypes[p] == &owner) {
+            glDeleteVertexArrays(1, &mPrototypeVaos[p]);
+            mPrototypeVaos[p] = 0;
+        }
+    }
+}
+
+void InstancedScene::render(RenderContext const& ctx)
+{
+    record(ctx.projMat * ctx.viewMat);
+
+    // bulk upload, one range per command list plus all the commands
+    for (std::size_t list{ 0 }; list < mListCount; ++list) {
+        if (mListSizes[list] == 0) {
+            continue;
+        }
+        std::size_t begin = list * mObjects.size() / mListCount;
+        glNamedBufferSubData(mInstanceBuffer, begin * sizeof(InstanceData),
+            mListSizes[list] * sizeof(InstanceData), mInstances.data() + begin);
+    }
+    glNamedBufferSubData(mIndirectBuffer, 0, mCommands.size() * sizeof(DrawCommand), mCommands.data());
+
+    // only the world matrices that moved since the last upload are written
+    mTransformSystem.upload();
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TransformBufferBinding, mTransformSystem.buffer());
+
+    // model and colour come from the instance data, the shader ignores the uniforms
+    bindUniforms(ctx, math::Matrix4{ 1.0f }, Colour{ 1.0f });
+
+    // replay: one multi-draw per prototype, one command per list
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mIndirectBuffer);
+    for (std::size_t p{ 0 }; p < mPrototypes.size(); ++p) {
+        Object const& prototype = *mPrototypes[p];
+        if (!prototype.isResident()) {
+            continue;
+        }
+        // a re-streamed buffer can get its old name back, so names cannot
+        // tell whether the vertex array is still current
+        if (mPrototypeVaos[p] == 0 || mPrototypeGenerations[p] != prototype.bufferGeneration()) {
+            bindPrototype(p);
+        }
+
+        glBindVertexArray(mPrototypeVaos[p]);
+        auto offset = reinterpret_cast<void const*>(p * mListCount * sizeof(DrawCommand));
+        if (prototype.indexBuffer() != 0) {
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, offset,
+                static_cast<GLsizei>(mListCount), sizeof(DrawCommand));
+        }
+        else {
+            glMultiDrawArraysIndirect(GL_TRIANGLES, offset,
+                static_cast<GLsizei>(mListCount), sizeof(DrawCommand));
+        }
+    }
     glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void InstancedScene::deleteLayout()
+{
+    glDeleteBuffers(1, &mInstanceBuffer);
+    glDeleteBuffers(1, &mIndirectBuffer);
+    mInstanceBuffer = 0;
+    mIndirectBuffer = 0;
+    glDeleteVertexArrays(static_cast<GLsizei>(mPrototypeVaos.size()), mPrototypeVaos.data());
+    mPrototypeVaos.assign(mPrototypeVaos.size(), 0);
+}
+
+void InstancedScene::freeGPUData()
+{
+    deleteLayout();
+    for (Object* prototype : mPrototypes) {
+        prototype->removeBufferUser(*this);
+    }
+    Object::freeGPUData();
+}
+
+std::size_t InstancedScene::cpuBytes() const
+{
+    return mObjects.capacity() * sizeof(SceneObject) +
+        mInstances.capacity() * sizeof(InstanceData) +
+        mCommands.capacity() * sizeof(DrawCommand);
 }
 
 // ===---------------CAMERA-----------------===
@@ -388,11 +1179,130 @@ Directional::Directional(atlas::math::Vector dir, Colour col, float rad) :
 
 
 
+// ===---------------RESIDENCY-----------------===
+
+ResidencyManager::ResidencyManager(std::size_t gpuBudget, std::size_t cpuBudget) :
+    mGpuBudget{ gpuBudget }, mCpuBudget{ cpuBudget }, mStats{}
+{}
+
+void ResidencyManager::track(Object& obj)
+{
+    mLastVisible.emplace(&obj, 0);
+    if (obj.isResident())
+    {
+        mStats.residentBytes += obj.gpuBytes();
+    }
+    if (!obj.keepsCPUCopy())
+    {
+        obj.dropCPUData();
+    }
+    updateCpuBytes();
+    // no frame is being drawn, so nothing needs to stay resident or keep its copy
+    evictFor(0, std::numeric_limits<std::uint64_t>::max());
+    enforceCpuBudget(std::numeric_limits<std::uint64_t>::max());
+}
+
+bool ResidencyManager::makeResident(Object& obj, std::uint64_t frame)
+{
+    mLastVisible[&obj] = frame;
+    if (obj.isResident())
+    {
+        return false;
+    }
+
+    evictFor(obj.gpuBytes(), frame);
+
+    double start = glfwGetTime();
+    std::size_t bytes = obj.restream();
+    mStats.reuploadSeconds += glfwGetTime() - start;
+    mStats.reuploads++;
+    mStats.reuploadBytes += bytes;
+    mStats.residentBytes += bytes;
+
+    if (!obj.keepsCPUCopy())
+    {
+        obj.dropCPUData();
+    }
+    updateCpuBytes();
+    enforceCpuBudget(frame);
+    return true;
+}
+
+void ResidencyManager::evictFor(std::size_t bytes, std::uint64_t frame)
+{
+    while (mStats.residentBytes + bytes > mGpuBudget)
+    {
+        // least recently visible object that is not drawn this frame
+        Object* victim{ nullptr };
+        std::uint64_t oldest{ frame };
+        for (auto const& [object, lastVisible] : mLastVisible)
+        {
+            if (object->isResident() && lastVisible < oldest)
+            {
+                victim = object;
+                oldest = lastVisible;
+            }
+        }
+
+        // everything resident is in use, go over budget rather than flicker
+        if (victim == nullptr)
+        {
+            return;
+        }
+
+        mStats.residentBytes -= victim->gpuBytes();
+        victim->releaseBuffers();
+        mStats.evictions++;
+    }
+}
+
+void ResidencyManager::enforceCpuBudget(std::uint64_t frame)
+{
+    // copies that were asked to be kept go first once RAM runs out,
+    // they can always be streamed back from their cache
+    while (mStats.cpuBytes > mCpuBudget)
+    {
+        Object* victim{ nullptr };
+        std::uint64_t oldest{ frame };
+        for (auto const& [object, lastVisible] : mLastVisible)
+        {
+            if (object->canDropCPUData() && lastVisible < oldest)
+            {
+                victim = object;
+                oldest = lastVisible;
+            }
+        }
+
+        if (victim == nullptr)
+        {
+            return;
+        }
+
+        mStats.cpuBytes -= victim->cpuBytes();
+        victim->dropCPUData();
+    }
+}
+
+void ResidencyManager::updateCpuBytes()
+{
+    mStats.cpuBytes = 0;
+    for (auto const& [object, lastVisible] : mLastVisible)
+    {
+        mStats.cpuBytes += object->cpuBytes();
+    }
+}
+
 // ===------------IMPLEMENTATIONS-------------===
 
 Program::Program(int width, int height, std::string title, Camera cam, glm::vec3 ambient, PointLight pointLight, Directional directional) :
     settings{}, callbacks{}, paused{}, mWindow{ nullptr }, mCamera{ cam }, mAmbient{ambient}, mPointLight{pointLight}, mDirectional{directional},
-    firstMouse{ true }, lastX{ settings.size.width / 2.0f }, lastY{ settings.size.width / 2.0f }, mSpecularFlag{}, mDirectionalFlag{}, meshFlag{}
+    firstMouse{ true }, lastX{ settings.size.width / 2.0f }, lastY{ settings.size.width / 2.0f }, mSpecularFlag{}, mDirectionalFlag{}, meshFlag{},
+    mRedrawMode{ RedrawMode::OnDemand }, mDirty{ true }, mFramePacing{ FramePacing::VSync }, mTargetFrameRate{ 144.0 },
+    mNextFrameDeadline{}, mFrameCostEstimate{}, mWorkCostEstimate{}, mRefreshPeriod{}, mLastPresent{},
+    mShowStats{}, mStats{},
+    mCacheFbo{}, mCacheColour{}, mCacheDepth{}, mCacheWidth{}, mCacheHeight{}, mArena{ FrameArenaSize },
+    mResidency{ nullptr }, mFrameIndex{ 0 }, mScene{ nullptr }, mSceneFlag{},
+    mTransforms{ nullptr }
 {
     settings.size.width  = width;
     settings.size.height = height;
@@ -415,30 +1325,34 @@ Program::Program(int width, int height, std::string title, Camera cam, glm::vec3
 
         if (key == GLFW_KEY_SPACE && action == GLFW_RELEASE) {
 			mSpecularFlag = !mSpecularFlag;
+            requestRedraw();
 		}
         if (key == GLFW_KEY_M && action == GLFW_RELEASE) {
             meshFlag = !meshFlag;
+            requestRedraw();
         }
         if (key == GLFW_KEY_L && action == GLFW_RELEASE) {
             mDirectionalFlag = !mDirectionalFlag;
+            requestRedraw();
         }
-        //https://learnopengl.com/Getting-started/Camera
-        if (key == GLFW_KEY_W && ( action == GLFW_PRESS || action == GLFW_REPEAT))
-        {
-            mCamera.mEye += CAM_SPEED * mCamera.mCentre;
+        if (key == GLFW_KEY_R && action == GLFW_RELEASE) {
+            auto next = (magic_enum::enum_integer(mRedrawMode) + 1) % magic_enum::enum_count<RedrawMode>();
+            setRedrawMode(magic_enum::enum_value<RedrawMode>(next));
+            fmt::print("redraw mode: {}\n", magic_enum::enum_name(mRedrawMode));
         }
-        if (key == GLFW_KEY_S && (action == GLFW_PRESS || action == GLFW_REPEAT))
-        {
-            mCamera.mEye -= CAM_SPEED * mCamera.mCentre;
+        if (key == GLFW_KEY_V && action == GLFW_RELEASE) {
+            auto next = (magic_enum::enum_integer(mFramePacing) + 1) % magic_enum::enum_count<FramePacing>();
+            setFramePacing(magic_enum::enum_value<FramePacing>(next), mTargetFrameRate);
+            fmt::print("frame pacing: {}\n", magic_enum::enum_name(mFramePacing));
         }
-        if (key == GLFW_KEY_A && (action == GLFW_PRESS || action == GLFW_REPEAT))
-        {
-            mCamera.mEye -= glm::normalize(glm::cross(mCamera.mCentre, mCamera.mUp)) * CAM_SPEED;
+        if (key == GLFW_KEY_F && action == GLFW_RELEASE) {
+            mShowStats = !mShowStats;
         }
-        if (key == GLFW_KEY_D && (action == GLFW_PRESS || action == GLFW_REPEAT))
-        {
-            mCamera.mEye += glm::normalize(glm::cross(mCamera.mCentre, mCamera.mUp)) * CAM_SPEED;
+        if (key == GLFW_KEY_B && action == GLFW_RELEASE) {
+            mSceneFlag = !mSceneFlag;
+            requestRedraw();
         }
+        // W/A/S/D are sampled once per frame in updateCamera
 	};
 
 
@@ -468,6 +1382,7 @@ Program::Program(int width, int height, std::string title, Camera cam, glm::vec3
         direction.y = sin(glm::radians(mCamera.mPitch));
         direction.z = sin(glm::radians(mCamera.mYaw)) * cos(glm::radians(mCamera.mPitch));
         mCamera.mCentre = glm::normalize(direction);
+        requestRedraw();
     };
 
 
@@ -479,32 +1394,411 @@ void Program::run(Object& obj, Object& obj2)
     glEnable(GL_DEPTH_TEST);
 
     glfwSetInputMode(mWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    glfwSetWindowRefreshCallback(mWindow, refreshCallback);
+
+    int lastWidth{0};
+    int lastHeight{0};
+    double lastResize{0.0};
+
+    double lastInput{glfwGetTime()};
+    double lastShaderPoll{0.0};
+    mNextFrameDeadline = lastInput;
+    bool moving{false};
+
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+    int drawnFrames{0};
+    int checkedFrames{0};
+#endif
 
     while (!glfwWindowShouldClose(mWindow))
     {
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+        // events, input and shader polling are part of the frame as well
+        std::size_t allocationsBefore = heapAllocationCount();
+
+        // cycle through the cube, the mesh and the scene and keep turning the
+        // one shown, so every draw path and the transform update are checked
+        meshFlag = drawnFrames % 3 == 1;
+        mSceneFlag = drawnFrames % 3 == 2;
+        if (mTransforms != nullptr) {
+            Object& shown = mSceneFlag && mScene != nullptr ? *mScene : meshFlag ? obj2 : obj;
+            mTransforms->setRotation(shown.transformNode(),
+                glm::angleAxis(drawnFrames * 0.01f, glm::vec3{ 0.0f, 1.0f, 0.0f }));
+        }
+#endif
+
+        bool idle = mRedrawMode != RedrawMode::Continuous && !mDirty && !moving;
+        if (idle) {
+            // wake up periodically to pick up shader edits and settled resizes
+            glfwWaitEventsTimeout(IdleWaitTimeout);
+        }
+        else {
+            waitForNextFrame();
+            glfwPollEvents();
+        }
+
+        // input is sampled after pacing, right before the frame is built, so it
+        // is as fresh as possible when presented
+        double inputTime = glfwGetTime();
+        // keys pressed during an idle wait have only just gone down
+        float dt = idle ? 0.0f : std::min(static_cast<float>(inputTime - lastInput), MaxFrameDelta);
+        lastInput = inputTime;
+        moving = updateCamera(dt);
+
+        // only the subtrees below moved nodes are recomputed, anything
+        // attached to them has to be drawn again
+        if (mTransforms != nullptr && mTransforms->update()) {
+            mDirty = true;
+        }
+
         int width;
         int height;
 
         glfwGetFramebufferSize(mWindow, &width, &height);
-        // setup the view to be the window's size
-        glViewport(0, 0, width, height);
-        // tell OpenGL the what color to clear the screen to
-        glClearColor(0, 0, 0, 1);
-        // actually clear the screen
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        if (!meshFlag) {
-            obj.render(paused, width, height, mCamera, mAmbient, mPointLight, mDirectional, mSpecularFlag, mDirectionalFlag);
+        bool resized = width != lastWidth || height != lastHeight;
+        if (resized) {
+            lastWidth = width;
+            lastHeight = height;
+            lastResize = glfwGetTime();
+        }
+        bool exposed = sExposed;
+        sExposed = false;
+
+        // nothing to draw into while minimized
+        if (width == 0 || height == 0) {
+            glfwWaitEvents();
+            lastInput = glfwGetTime();
+            continue;
         }
-        else {
-            obj2.render(paused, width, height, mCamera, mAmbient, mPointLight, mDirectional, mSpecularFlag, mDirectionalFlag);
 
+        // check both objects so that an edit is not missed while the other
+        // one is shown, a reload marks the object dirty. Looking up the file
+        // times goes through the heap, so it is only done a few times a second
+        bool polled = inputTime - lastShaderPoll >= ShaderPollInterval;
+        if (polled) {
+            lastShaderPoll = inputTime;
+            obj.reloadShaders();
+            obj2.reloadShaders();
+            if (mScene != nullptr) {
+                mScene->reloadShaders();
+            }
         }
 
-        glfwSwapBuffers(mWindow);
-        glfwPollEvents();
+        bool showScene = mSceneFlag && mScene != nullptr;
+        Object& active = showScene ? *mScene : meshFlag ? obj2 : obj;
+        bool cached = mRedrawMode == RedrawMode::OnDemandCached;
 
+        bool redraw = mRedrawMode == RedrawMode::Continuous || mDirty || active.isDirty();
+        if (!cached) {
+            redraw = redraw || resized || exposed;
+        }
+        else if (width != mCacheWidth || height != mCacheHeight) {
+            // keep stretching the old frame while the window is being dragged,
+            // shade a new one once the size has settled
+            redraw = redraw || glfwGetTime() - lastResize >= ResizeSettleTime;
+        }
+
+        if (redraw) {
+            // everything allocated for the previous frame is dead by now
+            mArena.reset();
+
+            if (cached) {
+                if (width != mCacheWidth || height != mCacheHeight) {
+                    createFrameCache(width, height);
+                }
+                glBindFramebuffer(GL_FRAMEBUFFER, mCacheFbo);
+            }
+
+            // setup the view to be the window's size
+            glViewport(0, 0, width, height);
+            // tell OpenGL the what color to clear the screen to
+            glClearColor(0, 0, 0, 1);
+            // actually clear the screen
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            RenderContext ctx{
+                paused, width, height,
+                //glm::perspective for pinhole, research other ones
+                glm::perspective(glm::radians(60.0f), static_cast<float>(width) / height, nearVal, farVal),
+                // giving camera in world space, so if we wanted to move it we would want to move the camera in camera space
+                glm::lookAt(mCamera.mEye, mCamera.mEye + mCamera.mCentre, mCamera.mUp),
+                mCamera, mAmbient, mPointLight, mDirectional, mSpecularFlag, mDirectionalFlag, mArena };
+
+            // build the draw list for this frame in the arena
+            Object* objects[] = { &obj, &obj2, mScene };
+            bool visible[] = { !showScene && !meshFlag, !showScene && meshFlag, showScene };
+            DrawItem* drawList = mArena.allocate<DrawItem>(std::size(objects));
+            std::size_t drawCount{0};
+            bool streamed{false};
+            mFrameIndex++;
+            for (std::size_t i{0}; i < std::size(objects); ++i) {
+                if (visible[i]) {
+                    // streaming recreates the buffers, so do it before taking the sort key
+                    if (mResidency != nullptr && objects[i] == mScene) {
+                        for (Object* prototype : mScene->prototypes()) {
+                            streamed = mResidency->makeResident(*prototype, mFrameIndex) || streamed;
+                        }
+                    }
+                    else if (mResidency != nullptr) {
+                        streamed = mResidency->makeResident(*objects[i], mFrameIndex) || streamed;
+                    }
+                    drawList[drawCount++] = DrawItem{ objects[i]->sortKey(), objects[i] };
+                }
+            }
+            std::sort(drawList, drawList + drawCount,
+                [](DrawItem const& a, DrawItem const& b) { return a.sortKey < b.sortKey; });
+
+            for (std::size_t i{0}; i < drawCount; ++i) {
+                drawList[i].object->render(ctx);
+                drawList[i].object->clearDirty();
+            }
+            mDirty = false;
+
+            if (cached) {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                presentFrameCache(width, height);
+            }
+            double submitTime = glfwGetTime();
+            glfwSwapBuffers(mWindow);
+            recordFrame(inputTime, submitTime, glfwGetTime());
+
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+            // a resize recreates the frame cache, streaming reads a mesh back
+            // in and shader polling reads the file times, everything else
+            // is steady state
+            if (++drawnFrames > AllocationCheckWarmup && !resized && !streamed && !polled) {
+                std::size_t allocations = heapAllocationCount() - allocationsBefore;
+                if (allocations != 0) {
+                    throw FrameAllocationError(fmt::format(
+                        "frame {} made {} heap allocations", drawnFrames, allocations));
+                }
+                if (++checkedFrames == AllocationCheckFrames) {
+                    fmt::print("no heap allocations in {} steady-state frames (arena high water {} bytes)\n",
+                        checkedFrames, mArena.highWater());
+                    glfwSetWindowShouldClose(mWindow, 1);
+                }
+            }
+#endif
+        }
+        else if (cached && (resized || exposed)) {
+            presentFrameCache(width, height);
+            glfwSwapBuffers(mWindow);
+            mLastPresent = glfwGetTime();
+        }
     }
+
+    freeFrameCache();
+}
+
+void Program::setRedrawMode(RedrawMode mode)
+{
+    mRedrawMode = mode;
+    mDirty = true;
+}
+
+void Program::setFramePacing(FramePacing pacing, double targetFrameRate)
+{
+    mFramePacing = pacing;
+    mTargetFrameRate = targetFrameRate;
+    mNextFrameDeadline = glfwGetTime();
+    applySwapInterval();
+}
+
+//https://learnopengl.com/Getting-started/Camera
+bool Program::updateCamera(float dt)
+{
+    glm::vec3 right = glm::normalize(glm::cross(mCamera.mCentre, mCamera.mUp));
+    glm::vec3 direction{0.0f};
+
+    if (glfwGetKey(mWindow, GLFW_KEY_W) == GLFW_PRESS) {
+        direction += mCamera.mCentre;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_S) == GLFW_PRESS) {
+        direction -= mCamera.mCentre;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_A) == GLFW_PRESS) {
+        direction -= right;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_D) == GLFW_PRESS) {
+        direction += right;
+    }
+
+    if (direction == glm::vec3{0.0f}) {
+        return false;
+    }
+
+    mCamera.mEye += CAM_SPEED * dt * direction;
+    requestRedraw();
+    return true;
+}
+
+void Program::applySwapInterval()
+{
+    switch (mFramePacing)
+    {
+    case FramePacing::VSync:
+        glfwSwapInterval(1);
+        break;
+    case FramePacing::AdaptiveVSync:
+        // a negative interval lets late frames tear instead of waiting a whole refresh
+        if (glfwExtensionSupported("WGL_EXT_swap_control_tear") ||
+            glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+        {
+            glfwSwapInterval(-1);
+        }
+        else
+        {
+            glfwSwapInterval(1);
+        }
+        break;
+    case FramePacing::Uncapped:
+    case FramePacing::TargetRate:
+        glfwSwapInterval(0);
+        break;
+    }
+}
+
+void Program::waitForNextFrame()
+{
+    double now = glfwGetTime();
+
+    if (mFramePacing == FramePacing::TargetRate) {
+        double period = 1.0 / mTargetFrameRate;
+
+        // fell behind (or just woke up from idle), start a fresh schedule
+        if (mNextFrameDeadline < now) {
+            mNextFrameDeadline = now;
+        }
+
+        // start the frame just late enough that it finishes at the deadline,
+        // which keeps the input it samples as recent as possible
+        sleepUntil(mNextFrameDeadline - std::min(mFrameCostEstimate, period));
+        mNextFrameDeadline += period;
+    }
+    else if (mFramePacing != FramePacing::Uncapped && mRefreshPeriod > 0.0) {
+        // the last swap returned at a vertical blank, so the next one is a
+        // refresh period later. Starting the frame right away would sample
+        // the input a whole refresh before it is shown, so wait until just
+        // enough time is left to build it. After an idle wait the blank is
+        // long gone and the frame starts at once
+        double vblank = mLastPresent + mRefreshPeriod;
+        if (vblank > now) {
+            sleepUntil(vblank - std::min(mWorkCostEstimate + VSyncSlack, mRefreshPeriod));
+        }
+    }
+}
+
+void Program::sleepUntil(double wake)
+{
+    double now = glfwGetTime();
+    if (wake - now > SpinThreshold) {
+        // the OS sleep is coarse, so stop short and spin for the rest
+        std::this_thread::sleep_for(std::chrono::duration<double>(wake - now - SpinThreshold));
+    }
+    while (glfwGetTime() < wake) {
+        std::this_thread::yield();
+    }
+}
+
+void Program::recordFrame(double inputTime, double submitTime, double presentTime)
+{
+    // input-to-present latency, up to the return of glfwSwapBuffers
+    double latency = presentTime - inputTime;
+    mFrameCostEstimate = mFrameCostEstimate * 0.9 + latency * 0.1;
+    // in the vsync modes the swap blocks until the blank, so the latency is
+    // no measure of the work. The slowest recent frames count the most
+    double work = submitTime - inputTime;
+    mWorkCostEstimate = std::max(work, mWorkCostEstimate * 0.9 + work * 0.1);
+    mLastPresent = presentTime;
+
+    if (mStats.lastPresent > 0.0) {
+        mStats.frameTime += presentTime - mStats.lastPresent;
+    }
+    mStats.lastPresent = presentTime;
+    mStats.latency += latency;
+    mStats.maxLatency = std::max(mStats.maxLatency, latency);
+    mStats.frames++;
+
+    if (presentTime - mStats.windowStart < StatsInterval) {
+        return;
+    }
+
+    if (mShowStats) {
+        fmt::print("{:.1f} fps, frame {:.2f} ms, input latency {:.2f} ms (max {:.2f} ms), pacing {}\n",
+            mStats.frames / (presentTime - mStats.windowStart),
+            1000.0 * mStats.frameTime / mStats.frames,
+            1000.0 * mStats.latency / mStats.frames,
+            1000.0 * mStats.maxLatency,
+            magic_enum::enum_name(mFramePacing));
+    }
+
+    if (mShowStats && mResidency != nullptr) {
+        ResidencyStats const& residency = mResidency->stats();
+        fmt::print("resident {:.1f} MiB GPU, {:.1f} MiB CPU, {} evictions, {} re-uploads ({:.1f} MiB at {:.1f} MiB/s)\n",
+            residency.residentBytes / 1048576.0,
+            residency.cpuBytes / 1048576.0,
+            residency.evictions,
+            residency.reuploads,
+            residency.reuploadBytes / 1048576.0,
+            residency.reuploadSeconds > 0.0 ? residency.reuploadBytes / 1048576.0 / residency.reuploadSeconds : 0.0);
+    }
+
+    mStats = FrameStats{};
+    mStats.windowStart = presentTime;
+    mStats.lastPresent = presentTime;
+}
+
+void Program::createFrameCache(int width, int height)
+{
+    freeFrameCache();
+
+    glCreateFramebuffers(1, &mCacheFbo);
+
+    glCreateRenderbuffers(1, &mCacheColour);
+    glNamedRenderbufferStorage(mCacheColour, GL_RGBA8, width, height);
+    glNamedFramebufferRenderbuffer(mCacheFbo, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, mCacheColour);
+
+    glCreateRenderbuffers(1, &mCacheDepth);
+    glNamedRenderbufferStorage(mCacheDepth, GL_DEPTH24_STENCIL8, width, height);
+    glNamedFramebufferRenderbuffer(mCacheFbo, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, mCacheDepth);
+
+    if (glCheckNamedFramebufferStatus(mCacheFbo, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        throw OpenGLError("Failed to create frame cache framebuffer");
+    }
+
+    mCacheWidth = width;
+    mCacheHeight = height;
+}
+
+void Program::freeFrameCache()
+{
+    if (mCacheFbo == 0) {
+        return;
+    }
+
+    glDeleteFramebuffers(1, &mCacheFbo);
+    glDeleteRenderbuffers(1, &mCacheColour);
+    glDeleteRenderbuffers(1, &mCacheDepth);
+    mCacheFbo = 0;
+    mCacheColour = 0;
+    mCacheDepth = 0;
+    mCacheWidth = 0;
+    mCacheHeight = 0;
+}
+
+void Program::presentFrameCache(int width, int height)
+{
+    if (mCacheFbo == 0) {
+        return;
+    }
+
+    // copy (and stretch, if the window was resized) the last frame to the back buffer
+    glBlitNamedFramebuffer(mCacheFbo, 0,
+        0, 0, mCacheWidth, mCacheHeight,
+        0, 0, width, height,
+        GL_COLOR_BUFFER_BIT, GL_LINEAR);
 }
 
 void Program::freeGPUData()
@@ -519,7 +1813,11 @@ void Program::createGLContext()
 
     glx::bindWindowCallbacks(mWindow, callbacks);
     glfwMakeContextCurrent(mWindow);
-    glfwSwapInterval(1);
+    applySwapInterval();
+
+    // the vsync modes time the start of a frame from the refresh rate
+    GLFWvidmode const* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    mRefreshPeriod = mode != nullptr && mode->refreshRate > 0 ? 1.0 / mode->refreshRate : 0.0;
 
     if (!glx::createGLContext(mWindow, settings.version))
     {
@@ -534,8 +1832,160 @@ void Program::createGLContext()
 
 // ===-----------------DRIVER-----------------===
 
-int main()
+// lays the scene out on a grid below the camera, alternating prototypes
+void buildScene(InstancedScene& scene, Object& first, Object& second)
+{
+    auto side = static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(SceneObjectCount))));
+    for (std::size_t i{0}; i < SceneObjectCount; ++i) {
+        std::size_t x = i % side;
+        std::size_t z = i / side;
+        math::Point position{ (x - side / 2.0f) * SceneSpacing, -3.0f, (z - side / 2.0f) * SceneSpacing };
+        Colour colour{ (x % 8) / 8.0f, 0.5f, (z % 8) / 8.0f };
+        scene.add((x + z) % 2 == 0 ? first : second, position, i * 0.37f, 0.5f, colour);
+    }
+}
+
+// times InstancedScene::record, the part that runs on the workers, for
+// every worker count up to the number of hardware threads
+void benchmarkRecording(InstancedScene& scene, Camera const& cam)
+{
+    auto projMat{ glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, nearVal, farVal) };
+    // look down on the grid so that a good part of it is visible
+    auto viewMat{ glm::lookAt(cam.mEye + glm::vec3{0.0f, 100.0f, 0.0f}, glm::vec3{0.0f, -3.0f, -100.0f}, cam.mUp) };
+    auto viewProj = projMat * viewMat;
+
+    std::size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    double baseline{0.0};
+
+    fmt::print("{} objects, {} frames per run\n", SceneObjectCount, BenchmarkFrames);
+    fmt::print("{:>8} {:>10} {:>8} {:>10}\n", "workers", "ms/frame", "speedup", "visible");
+    for (std::size_t threads{1}; threads <= maxThreads; ++threads) {
+        ThreadPool pool{threads};
+        scene.setThreadPool(pool);
+
+        std::size_t visible = scene.record(viewProj);
+        double start = glfwGetTime();
+        for (int i{0}; i < BenchmarkFrames; ++i) {
+            visible = scene.record(viewProj);
+        }
+        double ms = 1000.0 * (glfwGetTime() - start) / BenchmarkFrames;
+
+        if (threads == 1) {
+            baseline = ms;
+        }
+        fmt::print("{:>8} {:>10.3f} {:>8.2f} {:>10}\n", threads, ms, baseline / ms, visible);
+    }
+}
+
+// updates a large part hierarchy with a small fraction of it moving every
+// frame, for every worker count up to the number of hardware threads
+void benchmarkTransforms()
+{
+    std::size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t changes = TransformBenchNodes / TransformChangeRatio;
+    double baseline{0.0};
+
+    fmt::print("{} nodes, {} changed per frame, {} frames per run\n", TransformBenchNodes, changes, BenchmarkFrames);
+    fmt::print("{:>8} {:>10} {:>10} {:>8} {:>12} {:>12}\n",
+        "workers", "update ms", "upload ms", "speedup", "recomputed", "uploaded KiB");
+    for (std::size_t threads{1}; threads <= maxThreads; ++threads) {
+        ThreadPool pool{threads};
+        TransformSystem transforms{ pool };
+
+        // assemblies of parts, each part attached to one of the first quarter
+        // so the hierarchy is a few levels deep
+        for (std::size_t i{0}; i < TransformBenchNodes; ++i) {
+            std::size_t part = i % TransformAssemblySize;
+            auto parent = part == 0
+                ? TransformSystem::NoParent
+                : static_cast<TransformSystem::Node>(i - part + (part - 1) / 4);
+            transforms.add(parent, math::Point{ 0.0f, 0.5f, 0.0f },
+                glm::angleAxis(0.1f * part, glm::vec3{0.0f, 1.0f, 0.0f}), math::Vector{ 0.99f });
+        }
+        transforms.update();
+        transforms.upload();
+        glFinish();
+
+        std::minstd_rand random{ 305 };
+        std::uniform_int_distribution<TransformSystem::Node> pick{ 0, static_cast<TransformSystem::Node>(TransformBenchNodes - 1) };
+        double updateTime{0.0};
+        double uploadTime{0.0};
+        std::size_t recomputed{0};
+        std::size_t uploaded{0};
+        for (int frame{0}; frame < BenchmarkFrames; ++frame) {
+            auto rotation = glm::angleAxis(0.01f * frame, glm::vec3{0.0f, 1.0f, 0.0f});
+            for (std::size_t i{0}; i < changes; ++i) {
+                transforms.setRotation(pick(random), rotation);
+            }
+
+            double start = glfwGetTime();
+            transforms.update();
+            double updated = glfwGetTime();
+            uploaded += transforms.upload();
+            glFinish();
+            uploadTime += glfwGetTime() - updated;
+            updateTime += updated - start;
+            recomputed += transforms.recomputed();
+        }
+        transforms.freeGPUData();
+
+        double ms = 1000.0 * updateTime / BenchmarkFrames;
+        if (threads == 1) {
+            baseline = ms;
+        }
+        fmt::print("{:>8} {:>10.3f} {:>10.3f} {:>8.2f} {:>12} {:>12}\n", threads, ms,
+            1000.0 * uploadTime / BenchmarkFrames, baseline / ms,
+            recomputed / BenchmarkFrames, uploaded / BenchmarkFrames / 1024);
+    }
+}
+
+void printUsage()
+{
+    fmt::print("usage: a3 [--bench-record | --bench-transforms] [--gpu-budget <MiB>] [--cpu-budget <MiB>]\n"
+               "the budgets limit the mesh buffers kept on the GPU and the CPU copies kept\n"
+               "in memory, objects over them are evicted and streamed back when drawn\n");
+}
+
+int main(int argc, char* argv[])
 {
+    // --bench-record measures command recording and --bench-transforms the
+    // transform system instead of opening the viewer, the budgets are in MiB
+    bool benchRecord{ false };
+    bool benchTransforms{ false };
+    std::size_t gpuBudget{ DefaultGpuBudget };
+    std::size_t cpuBudget{ DefaultCpuBudget };
+
+    for (int i{ 1 }; i < argc; ++i)
+    {
+        std::string arg{ argv[i] };
+        if (arg == "--bench-record")
+        {
+            benchRecord = true;
+        }
+        else if (arg == "--bench-transforms")
+        {
+            benchTransforms = true;
+        }
+        else if ((arg == "--gpu-budget" || arg == "--cpu-budget") && i + 1 < argc)
+        {
+            std::string_view value{ argv[++i] };
+            std::size_t mebibytes{};
+            auto [last, error] = std::from_chars(value.data(), value.data() + value.size(), mebibytes);
+            if (error != std::errc{} || last != value.data() + value.size() ||
+                mebibytes > std::numeric_limits<std::size_t>::max() >> 20)
+            {
+                fmt::print("invalid budget: {}\n", value);
+                printUsage();
+                return 1;
+            }
+            (arg == "--gpu-budget" ? gpuBudget : cpuBudget) = mebibytes << 20;
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
 
     Camera cam{ glm::vec3{0.0f, 0.0f, 3.0f}, glm::vec3{0.0f,0.0f, -1.0f}, glm::vec3{0.0f, 1.0f, 0.0f } };
 
@@ -549,19 +1999,67 @@ int main()
         Directional d{ atlas::math::Vector{1.0f, 0.0f, 0.0f} , Colour{ 1.0f, 1.0f, 1.0f }, 0.9f };
 
         Program prog{1280, 720, "CSC305 Assignment 3", cam, ambient, p, d};
+#ifdef A3_CHECK_FRAME_ALLOCATIONS
+        // draw every frame as fast as possible so the check finishes quickly
+        prog.setRedrawMode(RedrawMode::Continuous);
+        prog.setFramePacing(FramePacing::Uncapped);
+#endif
         
         std::string shaderRoot{ ShaderPath };
 
-        atlas::utils::ObjMesh m = atlas::utils::loadObjMesh(shaderRoot + "suzanne.obj").value();
-        Mesh mesh{ m, Colour {0.2f, 0.8f, 0.0f} };
+        std::string objPath{ shaderRoot + "suzanne.obj" };
+        std::string cachePath{ shaderRoot + "suzanne.mesh" };
+
+        // skip parsing the OBJ when the binary cache is up to date
+        std::optional<MeshData> cached;
+        if (std::error_code ec; !std::filesystem::exists(objPath, ec) ||
+            std::filesystem::last_write_time(cachePath, ec) >= std::filesystem::last_write_time(objPath, ec))
+        {
+            cached = readMeshCache(cachePath);
+        }
+        Mesh mesh = cached
+            ? Mesh{ std::move(*cached), Colour {0.2f, 0.8f, 0.0f}, cachePath }
+            : Mesh{ atlas::utils::loadObjMesh(objPath).value(), Colour {0.2f, 0.8f, 0.0f}, cachePath };
         mesh.loadShaders();
         mesh.loadDataToGPU();
 
         Cube cube{ 1.0f, Colour{1.0f, 0.647f, 0.0f} };
         cube.loadShaders();
         cube.loadDataToGPU();
-        
-        prog.run(cube, mesh);
+
+        ResidencyManager residency{ gpuBudget, cpuBudget };
+        residency.track(cube);
+        residency.track(mesh);
+        prog.setResidencyManager(&residency);
+
+        ThreadPool pool;
+
+        // both objects hang below one root so they can be moved together
+        TransformSystem transforms{ pool };
+        auto root = transforms.add(TransformSystem::NoParent);
+        cube.setTransform(transforms, transforms.add(root));
+        mesh.setTransform(transforms, transforms.add(root));
+        prog.setTransforms(&transforms);
+
+        InstancedScene scene{ pool, transforms };
+        buildScene(scene, cube, mesh);
+        transforms.update();
+        scene.loadShaders();
+        scene.loadDataToGPU();
+
+        if (benchRecord) {
+            benchmarkRecording(scene, cam);
+            scene.setThreadPool(pool);
+        }
+        else if (benchTransforms) {
+            benchmarkTransforms();
+        }
+        else {
+            prog.setScene(&scene);
+            prog.run(cube, mesh);
+        }
+        scene.freeGPUData();
+        transforms.freeGPUData();
         prog.freeGPUData();
         cube.freeGPUData();
         mesh.freeGPUData();
@@ -571,6 +2069,15 @@ int main()
     {
         fmt::print("OpenGL Error:\n\t{}\n", err.what());
     }
+    catch (MeshCacheError& err)
+    {
+        fmt::print("Mesh Cache Error:\n\t{}\n", err.what());
+    }
+    catch (FrameAllocationError& err)
+    {
+        fmt::print("Frame Allocation Error:\n\t{}\n", err.what());
+        return 1;
+    }
 
     return 0;
 }
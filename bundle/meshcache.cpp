@@ -0,0 +1,132 @@
+#include "meshcache.hpp"
+
+#include <cstring>
+#include <fstream>
+
+namespace
+{
+    struct MeshCacheHeader
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint64_t lodCount;
+    };
+
+    struct MeshCacheLod
+    {
+        std::uint64_t vertexCount;
+        std::uint64_t indexCount;
+    };
+
+    bool writeLevels(std::string const& path, MeshData const* lods, std::size_t count)
+    {
+        std::ofstream file{path, std::ios::binary | std::ios::trunc};
+        if (!file)
+        {
+            return false;
+        }
+
+        MeshCacheHeader header{};
+        std::memcpy(header.magic, MeshCacheMagic, sizeof(header.magic));
+        header.version = MeshCacheVersion;
+        header.lodCount = count;
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+        for (std::size_t i{0}; i < count; ++i)
+        {
+            MeshCacheLod lod{lods[i].vertices.size(), lods[i].indices.size()};
+            file.write(reinterpret_cast<char const*>(&lod), sizeof(lod));
+        }
+        for (std::size_t i{0}; i < count; ++i)
+        {
+            file.write(reinterpret_cast<char const*>(lods[i].vertices.data()),
+                lods[i].vertices.size() * sizeof(SimpleVertex));
+            file.write(reinterpret_cast<char const*>(lods[i].indices.data()),
+                lods[i].indices.size() * sizeof(std::uint32_t));
+        }
+        return static_cast<bool>(file);
+    }
+} // namespace
+
+MeshData meshDataFromObj(atlas::utils::ObjMesh const& mesh)
+{
+    MeshData data;
+    data.vertices.reserve(mesh.shapes[0].vertices.size());
+    data.indices.reserve(mesh.shapes[0].indices.size());
+
+    for (atlas::utils::Vertex const& v : mesh.shapes[0].vertices) {
+        SimpleVertex sV;
+        sV.position = v.position;
+        sV.normal = v.normal;
+        data.vertices.push_back(sV);
+    }
+    for (size_t i : mesh.shapes[0].indices) {
+        data.indices.push_back(static_cast<std::uint32_t>(i));
+    }
+    return data;
+}
+
+bool writeMeshCache(std::string const& path, MeshData const& data)
+{
+    return writeLevels(path, &data, 1);
+}
+
+bool writeMeshCache(std::string const& path, std::vector<MeshData> const& lods)
+{
+    return writeLevels(path, lods.data(), lods.size());
+}
+
+std::optional<MeshData> readMeshCache(std::string const& path)
+{
+    std::ifstream file{path, std::ios::binary | std::ios::ate};
+    if (!file)
+    {
+        return {};
+    }
+    auto fileSize = static_cast<std::uint64_t>(file.tellg());
+    file.seekg(0);
+
+    MeshCacheHeader header{};
+    MeshCacheLod lod{};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, MeshCacheMagic, sizeof(header.magic)) != 0 ||
+        header.version != MeshCacheVersion || header.lodCount == 0 ||
+        !file.read(reinterpret_cast<char*>(&lod), sizeof(lod)))
+    {
+        return {};
+    }
+
+    // the counts are only trusted once the file is known to be big enough
+    // to hold them, a corrupt one must not make us allocate gigabytes
+    std::uint64_t remaining = fileSize - sizeof(header);
+    if (header.lodCount > remaining / sizeof(MeshCacheLod))
+    {
+        return {};
+    }
+    remaining -= header.lodCount * sizeof(MeshCacheLod);
+    if (lod.vertexCount > remaining / sizeof(SimpleVertex))
+    {
+        return {};
+    }
+    remaining -= lod.vertexCount * sizeof(SimpleVertex);
+    if (lod.indexCount > remaining / sizeof(std::uint32_t))
+    {
+        return {};
+    }
+
+    // level 0 follows right after the table of counts
+    file.seekg((header.lodCount - 1) * sizeof(MeshCacheLod), std::ios::cur);
+
+    MeshData data;
+    data.vertices.resize(lod.vertexCount);
+    data.indices.resize(lod.indexCount);
+    file.read(reinterpret_cast<char*>(data.vertices.data()),
+        data.vertices.size() * sizeof(SimpleVertex));
+    file.read(reinterpret_cast<char*>(data.indices.data()),
+        data.indices.size() * sizeof(std::uint32_t));
+    if (!file)
+    {
+        return {};
+    }
+    return data;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <atlas/utils/LoadObjFile.hpp>
+
+struct MeshCacheError : std::runtime_error
+{
+    MeshCacheError(const std::string& what_arg) : std::runtime_error(what_arg){};
+    MeshCacheError(const char* what_arg) : std::runtime_error(what_arg){};
+};
+
+struct SimpleVertex
+{
+    atlas::math::Point position{};
+    atlas::math::Normal normal{};
+};
+
+// vertex and index data exactly as it is uploaded to the GPU
+struct MeshData
+{
+    std::vector<SimpleVertex> vertices;
+    std::vector<std::uint32_t> indices;
+};
+
+// the binary cache is a small header, the vertex and index counts of every
+// level of detail and then their raw arrays, so it can be streamed back in
+// without parsing the OBJ again. Level 0 is the full-detail mesh.
+static constexpr char MeshCacheMagic[4]{'A', '3', 'M', 'C'};
+static constexpr std::uint32_t MeshCacheVersion{2};
+
+// converts the first shape of an OBJ file
+MeshData meshDataFromObj(atlas::utils::ObjMesh const& mesh);
+
+bool writeMeshCache(std::string const& path, MeshData const& data);
+bool writeMeshCache(std::string const& path, std::vector<MeshData> const& lods);
+
+// reads level 0, returns nothing if the file is missing, truncated or from
+// another version
+std::optional<MeshData> readMeshCache(std::string const& path);
@@ -0,0 +1,238 @@
+#include "threadpool.hpp"
+
+namespace
+{
+    // lets submit() find the queue of the worker it is called from
+    thread_local ThreadPool const* currentPool{nullptr};
+    thread_local std::size_t currentWorker{0};
+} // namespace
+
+// ===-------------THREAD POOL---------------===
+
+ThreadPool::ThreadPool(std::size_t threadCount) :
+    mPending{0}, mNextQueue{0}, mStop{false}
+{
+    threadCount = std::max<std::size_t>(threadCount, 1);
+
+    for (std::size_t i{0}; i < threadCount; ++i)
+    {
+        mQueues.push_back(std::make_unique<Queue>());
+        mQueues.back()->tasks.resize(TaskQueueCapacity);
+    }
+    for (std::size_t i{0}; i < threadCount; ++i)
+    {
+        mThreads.emplace_back([this, i]() { workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock{mSleepMutex};
+        mStop = true;
+    }
+    mWake.notify_all();
+
+    for (std::thread& thread : mThreads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(Task const& task)
+{
+    std::size_t index = currentPool == this
+        ? currentWorker
+        : mNextQueue.fetch_add(1, std::memory_order_relaxed) % mQueues.size();
+    Queue& queue = *mQueues[index];
+
+    // count the task before it becomes visible so the counter never wraps
+    mPending.fetch_add(1);
+    {
+        std::unique_lock<std::mutex> lock{queue.mutex};
+        if (queue.count == queue.tasks.size())
+        {
+            // growing the queue would allocate, running the task here
+            // gives the same result
+            lock.unlock();
+            mPending.fetch_sub(1);
+            execute(task);
+            return;
+        }
+        queue.tasks[(queue.head + queue.count) % queue.tasks.size()] = task;
+        queue.count++;
+    }
+
+    // taking the lock orders this against a worker that is about to sleep
+    {
+        std::lock_guard<std::mutex> lock{mSleepMutex};
+    }
+    mWake.notify_one();
+}
+
+bool ThreadPool::runPendingTask()
+{
+    Task task{};
+    bool found = currentPool == this
+        ? popLocal(currentWorker, task) || steal(currentWorker, task)
+        : steal(mQueues.size(), task);
+    if (!found)
+    {
+        return false;
+    }
+
+    mPending.fetch_sub(1);
+    execute(task);
+    return true;
+}
+
+void ThreadPool::execute(Task const& task)
+{
+    task.fn(task.context, task.begin, task.end);
+    if (task.outstanding != nullptr)
+    {
+        task.outstanding->fetch_sub(1);
+    }
+}
+
+bool ThreadPool::popLocal(std::size_t index, Task& task)
+{
+    Queue& queue = *mQueues[index];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    if (queue.count == 0)
+    {
+        return false;
+    }
+
+    // newest first, its data is most likely still in cache
+    queue.count--;
+    task = queue.tasks[(queue.head + queue.count) % queue.tasks.size()];
+    return true;
+}
+
+bool ThreadPool::steal(std::size_t thief, Task& task)
+{
+    for (std::size_t offset{1}; offset <= mQueues.size(); ++offset)
+    {
+        std::size_t index = (thief + offset) % mQueues.size();
+        if (index == thief)
+        {
+            continue;
+        }
+
+        Queue& queue = *mQueues[index];
+        std::lock_guard<std::mutex> lock{queue.mutex};
+        if (queue.count > 0)
+        {
+            // oldest first, it tends to be the biggest chunk of work
+            task = queue.tasks[queue.head];
+            queue.head = (queue.head + 1) % queue.tasks.size();
+            queue.count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(std::size_t index)
+{
+    currentPool = this;
+    currentWorker = index;
+
+    while (true)
+    {
+        if (runPendingTask())
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock{mSleepMutex};
+        mWake.wait(lock, [this]() { return mStop || mPending > 0; });
+        if (mStop && mPending == 0)
+        {
+            return;
+        }
+    }
+}
+
+// ===--------------TASK GROUP---------------===
+
+TaskGroup::TaskGroup(ThreadPool& pool) :
+    mPool{pool}, mOutstanding{0}
+{}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::run(ThreadPool::TaskFn fn, void* context, std::size_t begin, std::size_t end)
+{
+    mOutstanding.fetch_add(1);
+    mPool.submit(ThreadPool::Task{fn, context, begin, end, &mOutstanding});
+}
+
+void TaskGroup::wait()
+{
+    while (mOutstanding > 0)
+    {
+        if (!mPool.runPendingTask())
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// ===--------------TASK GRAPH---------------===
+
+TaskGraph::Task TaskGraph::add(std::function<void()> fn)
+{
+    mNodes.emplace_back();
+    mNodes.back().fn = std::move(fn);
+    return mNodes.size() - 1;
+}
+
+void TaskGraph::precede(Task before, Task after)
+{
+    mNodes[before].successors.push_back(after);
+    mNodes[after].predecessors++;
+}
+
+void TaskGraph::run(ThreadPool& pool)
+{
+    TaskGroup group{pool};
+    mGroup = &group;
+
+    for (Node& node : mNodes)
+    {
+        node.remaining = node.predecessors;
+    }
+    for (Task task{0}; task < mNodes.size(); ++task)
+    {
+        if (mNodes[task].predecessors == 0)
+        {
+            schedule(task);
+        }
+    }
+
+    group.wait();
+    mGroup = nullptr;
+}
+
+void TaskGraph::schedule(Task task)
+{
+    mGroup->run([](void* context, std::size_t task, std::size_t) {
+        auto& graph = *static_cast<TaskGraph*>(context);
+        Node& node = graph.mNodes[task];
+        node.fn();
+
+        // the last predecessor to finish starts the successor
+        for (Task successor : node.successors)
+        {
+            if (graph.mNodes[successor].remaining.fetch_sub(1) == 1)
+            {
+                graph.schedule(successor);
+            }
+        }
+    }, this, task);
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// tasks queued per worker before submit() starts running them inline
+static constexpr std::size_t TaskQueueCapacity{4096};
+
+// fixed set of worker threads, each with its own task queue. A worker takes
+// its newest task first and, once its queue is empty, steals the oldest
+// task from another worker, so nested work spreads out on its own.
+// Tasks must not throw.
+class ThreadPool
+{
+public:
+    using TaskFn = void (*)(void* context, std::size_t begin, std::size_t end);
+
+    // a function pointer and its arguments, so queueing a task never
+    // touches the heap
+    struct Task
+    {
+        TaskFn fn;
+        void* context;
+        std::size_t begin;
+        std::size_t end;
+        std::atomic<std::size_t>* outstanding; //decremented once fn returns, may be null
+    };
+
+    ThreadPool(std::size_t threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    // tasks submitted from a worker go to that worker's own queue, a full
+    // queue runs the task right away on the calling thread
+    void submit(Task const& task);
+
+    // runs one pending task on the calling thread, returns false if there was none
+    bool runPendingTask();
+
+    std::size_t threadCount() const { return mThreads.size(); }
+
+private:
+    // ring buffer allocated once, head is the oldest task
+    struct Queue
+    {
+        std::mutex mutex;
+        std::vector<Task> tasks;
+        std::size_t head{0};
+        std::size_t count{0};
+    };
+
+    static void execute(Task const& task);
+    bool popLocal(std::size_t index, Task& task);
+    bool steal(std::size_t thief, Task& task);
+    void workerLoop(std::size_t index);
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mThreads;
+    std::atomic<std::size_t> mPending;
+    std::atomic<std::size_t> mNextQueue;
+    std::atomic<bool> mStop;
+    std::mutex mSleepMutex;
+    std::condition_variable mWake;
+};
+
+// counts the tasks it started so the caller can wait for all of them
+class TaskGroup
+{
+public:
+    TaskGroup(ThreadPool& pool);
+    ~TaskGroup();
+
+    // calls fn(context, begin, end) on the pool, context has to stay valid
+    // until wait() returns
+    void run(ThreadPool::TaskFn fn, void* context, std::size_t begin = 0, std::size_t end = 0);
+
+    // helps with pending work until every task of the group has finished
+    void wait();
+
+private:
+    ThreadPool& mPool;
+    std::atomic<std::size_t> mOutstanding;
+};
+
+// calls fn(begin, end) on chunks of at most grain elements of [0, count)
+template <typename Fn>
+void parallelFor(ThreadPool& pool, std::size_t count, std::size_t grain, Fn const& fn)
+{
+    if (count <= grain)
+    {
+        fn(std::size_t{0}, count);
+        return;
+    }
+
+    // fn outlives every chunk and is only ever called as const
+    auto chunk = [](void* context, std::size_t begin, std::size_t end) {
+        (*static_cast<Fn const*>(context))(begin, end);
+    };
+    void* context = const_cast<void*>(static_cast<void const*>(&fn));
+
+    TaskGroup group{pool};
+    for (std::size_t begin{0}; begin < count; begin += grain)
+    {
+        group.run(chunk, context, begin, std::min(begin + grain, count));
+    }
+    group.wait();
+}
+
+// tasks with dependencies, each one is started once all of its
+// predecessors have finished
+class TaskGraph
+{
+public:
+    using Task = std::size_t;
+
+    Task add(std::function<void()> fn);
+
+    // after will not start before before has finished
+    void precede(Task before, Task after);
+
+    // blocks, helping the pool, until every task has run once
+    void run(ThreadPool& pool);
+
+    std::size_t size() const { return mNodes.size(); }
+
+private:
+    struct Node
+    {
+        std::function<void()> fn;
+        std::vector<Task> successors;
+        std::size_t predecessors{0};
+        std::atomic<std::size_t> remaining{0};
+    };
+
+    void schedule(Task task);
+
+    // a deque keeps the nodes in place, atomics cannot be moved
+    std::deque<Node> mNodes;
+    TaskGroup* mGroup{nullptr}; //only set while run() is in progress
+};